@@ -2,30 +2,349 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <limits.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <dirent.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Define the structure for a Town
 typedef struct Town {
-    char district[50]; // Name of the district
+    int districtId;    // Id of the district in the district table
     char town[50];     // Name of the town
     int population;    // Population of the town
     int elevation;     // Elevation of the town
-    char hasMunicipality[4]; // "yes" or "no" indicating if the town has a municipality
+    unsigned char hasMunicipality; // 1 if the town has a municipality, 0 if not
+    int row;            // Row of the town in the bitmap indexes
     struct Town *left;  // Pointer to the left child in the AVL tree
     struct Town *right; // Pointer to the right child in the AVL tree
     int height;         // Height of the node in the AVL tree
+    int size;           // Number of towns in the subtree rooted at this node
+    long long populationSum; // Total population of the subtree rooted at this node
+    struct Town *popLeft;  // Left child in the population index
+    struct Town *popRight; // Right child in the population index
+    int popHeight;         // Height of the node in the population index
 } Town;
 
+// Define the structure for the Town allocator: towns are carved out of large
+// slabs and recycled through a free list instead of one malloc per node
+#define TOWN_SLAB_SIZE 4096 // Towns per slab unless a larger reservation is requested
+
+typedef struct TownSlab {
+    struct TownSlab *next; // Next slab in the pool
+    int capacity;          // Number of towns in this slab
+    int used;              // Towns handed out from this slab so far
+    Town towns[];          // Slab storage
+} TownSlab;
+
+typedef struct TownPool {
+    TownSlab *slabs;         // Most recent slab first
+    Town *freeList;          // Released towns, linked through their left pointer
+    long allocations;        // Towns handed out over the pool's lifetime
+    long frees;              // Towns given back over the pool's lifetime
+    long live;               // Towns currently in use
+    long slabCount;          // Number of slabs allocated
+    size_t bytesReserved;    // Bytes requested from malloc for slabs
+} TownPool;
+
+static TownPool townPool; // Allocator shared by every Town node
+
+// Function to add a slab with room for at least `count` towns to the pool
+void addTownSlab(int count) {
+    if (count < TOWN_SLAB_SIZE)
+        count = TOWN_SLAB_SIZE;
+
+    size_t bytes = sizeof(TownSlab) + (size_t)count * sizeof(Town);
+    TownSlab *slab = (TownSlab*)malloc(bytes);
+    if (slab == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    slab->capacity = count;
+    slab->used = 0;
+    slab->next = townPool.slabs;
+    townPool.slabs = slab;
+    townPool.slabCount++;
+    townPool.bytesReserved += bytes;
+}
+
+// Function to make sure the next `count` allocations need no further slab
+void reserveTowns(int count) {
+    TownSlab *slab = townPool.slabs;
+    int available = slab != NULL ? slab->capacity - slab->used : 0;
+    if (available < count)
+        addTownSlab(count);
+}
+
+// Function to take a town from the pool
+Town* allocTown(void) {
+    Town *node = townPool.freeList;
+    if (node != NULL) {
+        townPool.freeList = node->left; // Reuse a released town first
+    } else {
+        if (townPool.slabs == NULL || townPool.slabs->used == townPool.slabs->capacity)
+            addTownSlab(TOWN_SLAB_SIZE);
+        node = &townPool.slabs->towns[townPool.slabs->used++];
+    }
+    townPool.allocations++;
+    townPool.live++;
+    return node;
+}
+
+// Function to take `count` consecutive towns from one slab, so several threads
+// can fill in their own share without touching the pool; count must be positive
+Town* allocTownRun(int count) {
+    reserveTowns(count);
+    TownSlab *slab = townPool.slabs;
+    Town *run = &slab->towns[slab->used];
+    slab->used += count;
+    townPool.allocations += count;
+    townPool.live += count;
+    return run;
+}
+
+// Function to give a town back to the pool
+void freeTown(Town *node) {
+    node->left = townPool.freeList;
+    townPool.freeList = node;
+    townPool.frees++;
+    townPool.live--;
+}
+
+// Function to release every slab of the pool at once
+void destroyTownPool(void) {
+    TownSlab *slab = townPool.slabs;
+    while (slab != NULL) {
+        TownSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(&townPool, 0, sizeof(townPool));
+}
+
+// Define the runtime counters: they are always on, updated only by the thread
+// holding the writer lock, and dumped as text or JSON from the menu or batch mode
+#define ROTATE_LEFT_LEFT 0   // One right rotation
+#define ROTATE_RIGHT_RIGHT 1 // One left rotation
+#define ROTATE_LEFT_RIGHT 2  // A left rotation of the left child, then a right rotation
+#define ROTATE_RIGHT_LEFT 3  // A right rotation of the right child, then a left rotation
+#define ROTATION_CASES 4
+
+#define PROBE_BUCKETS 9 // Probes per hash lookup: 1, 2, 3, 4, 5-8, 9-16, 17-32, 33-64, 65+
+
+// Operations timed in OperationTimer
+#define TIMER_INSERT 0
+#define TIMER_FIND 1
+#define TIMER_UPDATE 2
+#define TIMER_DELETE 3
+#define TIMER_LOAD 4
+#define TIMER_SAVE 5
+#define TIMER_MULTIGET 6
+#define TIMERS 7
+#define TIMER_BUCKETS 40 // Durations up to 2^39 ns (about 9 minutes), longer ones share the last bucket
+
+static const char *timerNames[TIMERS] = { "insert", "find", "update", "delete", "load", "save", "multiget" };
+
+typedef struct OperationTimer {
+    long count;                    // Calls timed
+    uint64_t totalNanoseconds;     // Time spent in them
+    uint64_t maxNanoseconds;       // Slowest call
+    long histogram[TIMER_BUCKETS]; // Calls by the bit length of their duration in nanoseconds
+} OperationTimer;
+
+typedef struct RuntimeStats {
+    long rotations[ROTATION_CASES]; // AVL rebalancing steps in the name tree, by case
+    long probes[PROBE_BUCKETS];     // Hash lookups by the number of slots they probed
+    OperationTimer timers[TIMERS];  // Latency of the registry operations
+} RuntimeStats;
+
+static RuntimeStats stats; // Counters for the whole process
+
+// Function to read a monotonic clock in nanoseconds
+uint64_t monotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Function to add the time since `started` to an operation timer
+void recordOperation(int timer, uint64_t started) {
+    uint64_t elapsed = monotonicNanoseconds() - started;
+    OperationTimer *t = &stats.timers[timer];
+    int bucket = elapsed == 0 ? 0 : 64 - __builtin_clzll(elapsed);
+    t->count++;
+    t->totalNanoseconds += elapsed;
+    if (elapsed > t->maxNanoseconds)
+        t->maxNanoseconds = elapsed;
+    t->histogram[bucket < TIMER_BUCKETS ? bucket : TIMER_BUCKETS - 1]++;
+}
+
+// Function to estimate a latency percentile of a timer from its histogram:
+// the upper bound of the bucket it falls in, capped by the slowest call
+uint64_t timerPercentile(OperationTimer *t, double fraction) {
+    long rank = (long)(t->count * fraction), seen = 0;
+    for (int bucket = 0; bucket < TIMER_BUCKETS - 1; bucket++) {
+        seen += t->histogram[bucket];
+        if (seen > rank)
+            return (1ULL << bucket) - 1 < t->maxNanoseconds ? (1ULL << bucket) - 1 : t->maxNanoseconds;
+    }
+    return t->maxNanoseconds;
+}
+
+// Function to get the number of single rotations made in the AVL tree so far
+long countRotations(void) {
+    return stats.rotations[ROTATE_LEFT_LEFT] + stats.rotations[ROTATE_RIGHT_RIGHT] +
+           2 * (stats.rotations[ROTATE_LEFT_RIGHT] + stats.rotations[ROTATE_RIGHT_LEFT]);
+}
+
+// Define the epoch-based reclaimer: memory that lock-free readers may still be
+// looking at (the slot arrays a hash table has moved away from) is retired
+// instead of freed, and released once every reader that could have seen it
+// has left its read section
+#define MAX_READERS 256 // Reader threads that can hold a reclaimer slot at once
+
+typedef struct RetiredBlock {
+    void *memory;              // Block to free
+    uint64_t epoch;            // Global epoch when the block was unlinked
+    struct RetiredBlock *next;
+} RetiredBlock;
+
+typedef struct EpochReclaimer {
+    atomic_uint_fast64_t epoch;                // Advanced on every retirement
+    atomic_uint_fast64_t readers[MAX_READERS]; // Epoch each reader entered at, 0 while it is idle
+    atomic_int claimed[MAX_READERS];           // 1 while a thread owns the slot
+    RetiredBlock *retired;                     // Blocks waiting to be freed (writer only)
+    long retiredCount;                         // Blocks retired over the process lifetime
+    long reclaimedCount;                       // Blocks freed after their grace period
+} EpochReclaimer;
+
+static EpochReclaimer reclaimer = { .epoch = 1 }; // Shared by every lock-free reader
+static _Thread_local int readerSlot = -1;         // This thread's slot in reclaimer.readers
+
+// Function to claim a reader slot for the calling thread; returns -1 if all are taken
+int acquireReaderSlot(void) {
+    if (readerSlot >= 0)
+        return readerSlot;
+    for (int i = 0; i < MAX_READERS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&reclaimer.claimed[i], &expected, 1)) {
+            readerSlot = i;
+            break;
+        }
+    }
+    return readerSlot;
+}
+
+// Function to give the calling thread's reader slot back, e.g. before the thread exits
+void releaseReaderSlot(void) {
+    if (readerSlot < 0)
+        return;
+    atomic_store(&reclaimer.readers[readerSlot], 0);
+    atomic_store(&reclaimer.claimed[readerSlot], 0);
+    readerSlot = -1;
+}
+
+// Function to announce that a reader may now hold pointers to shared memory
+static inline void enterReadSection(int slot) {
+    atomic_store(&reclaimer.readers[slot], atomic_load(&reclaimer.epoch));
+}
+
+// Function to announce that a reader holds no more pointers to shared memory
+static inline void leaveReadSection(int slot) {
+    atomic_store_explicit(&reclaimer.readers[slot], 0, memory_order_release);
+}
+
+// Function to free the retired blocks no reader can still be looking at
+void reclaimMemory(void) {
+    // Readers that entered before a block was retired may still use it
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < MAX_READERS; i++) {
+        uint64_t entered = atomic_load(&reclaimer.readers[i]);
+        if (entered != 0 && entered < oldest)
+            oldest = entered;
+    }
+
+    RetiredBlock **link = &reclaimer.retired;
+    while (*link != NULL) {
+        RetiredBlock *block = *link;
+        if (block->epoch < oldest) {
+            *link = block->next;
+            free(block->memory);
+            free(block);
+            reclaimer.reclaimedCount++;
+        } else {
+            link = &block->next;
+        }
+    }
+}
+
+// Function to free a block that has just been unlinked from a shared structure,
+// as soon as the readers that may have seen it are gone
+void retireMemory(void *memory) {
+    RetiredBlock *block = (RetiredBlock*)malloc(sizeof(RetiredBlock));
+    if (block == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    block->memory = memory;
+    block->epoch = atomic_fetch_add(&reclaimer.epoch, 1); // Readers entering from now on cannot see it
+    block->next = reclaimer.retired;
+    reclaimer.retired = block;
+    reclaimer.retiredCount++;
+    reclaimMemory();
+}
+
 // Define the structure for a Hash Table
-#define TABLE_SIZE 10 // Size of the hash table
+#define HASH_INITIAL_CAPACITY 16  // Initial number of slots (rounded up to a power of two)
+#define HASH_MAX_LOAD_FACTOR 0.75 // Default load factor that triggers a resize
+#define HASH_MIGRATE_STEP 16      // Old slots moved into the resized table per insert/delete
+#define HASH_MAX_TOMBSTONES 0.25  // Fraction of deleted slots that triggers a compaction
+
+// Slot states stored in HashTableEntry.isOccupied
+#define SLOT_EMPTY 0    // Slot has never been used, ends a probe chain
+#define SLOT_OCCUPIED 1 // Slot holds a town
+#define SLOT_DELETED 2  // Slot was vacated, probe chains continue past it
 
 typedef struct HashTableEntry {
-    char town[50];     // Name of the town
-    Town *townData;    // Pointer to the town data in the AVL tree
-    int isOccupied;    // Flag to indicate if the slot is occupied
+    Town *townData;         // Town in the AVL tree; its name is the key, so it is not copied here
+    unsigned int hashValue; // Cached hash of the town name
+    int isOccupied;         // Slot state (SLOT_EMPTY, SLOT_OCCUPIED or SLOT_DELETED)
 } HashTableEntry;
 
+// Define where the slot arrays are, as lock-free readers see them. A resize
+// publishes a new view instead of changing fields the readers load.
+typedef struct HashTableView {
+    HashTableEntry *entries;    // HashTable.entries when the view was published
+    int capacity;               // HashTable.capacity
+    HashTableEntry *oldEntries; // HashTable.oldEntries
+    int oldCapacity;            // HashTable.oldCapacity
+} HashTableView;
+
 typedef struct HashTable {
-    HashTableEntry *entries[TABLE_SIZE]; // Array of pointers to hash table entries
+    HashTableEntry *entries;    // Inline array of slots (no per-entry allocation)
+    int capacity;               // Number of slots in entries, always a power of two
+    int used;                   // Non-empty slots in entries (towns and tombstones)
+    int tombstones;             // SLOT_DELETED slots in entries
+    HashTableEntry *oldEntries; // Slots still being migrated after a resize (NULL if none)
+    int oldCapacity;            // Number of slots in oldEntries
+    int migrateIndex;           // Next slot of oldEntries to move into entries
+    int count;                  // Number of towns stored across both arrays
+    double maxLoadFactor;       // Load factor that triggers a resize
+    int resizeCount;            // Number of resizes performed so far
+    int compactionCount;        // Number of same-size rebuilds that dropped tombstones
+    _Atomic(HashTableView*) view; // Slot arrays published to lock-free readers
 } HashTable;
 
 // Function to get the height of a node in the AVL tree
@@ -40,17 +359,52 @@ int max(int a, int b) {
     return (a > b) ? a : b;
 }
 
+// Function to get the number of towns in a subtree
+int subtreeSize(Town *node) {
+    if (node == NULL)
+        return 0;
+    return node->size;
+}
+
+// Function to get the total population of a subtree
+long long subtreePopulation(Town *node) {
+    if (node == NULL)
+        return 0;
+    return node->populationSum;
+}
+
+// Function to recompute a node's height, size and population sum from its children
+void updateTown(Town *node) {
+    node->height = max(height(node->left), height(node->right)) + 1;
+    node->size = subtreeSize(node->left) + subtreeSize(node->right) + 1;
+    node->populationSum = subtreePopulation(node->left) + subtreePopulation(node->right) + node->population;
+}
+
+// Function to copy a name into a town with relaxed atomic stores: the node may
+// be recycled while a lock-free reader is still comparing its old name
+void storeTownName(Town *node, const char *town) {
+    size_t i = 0;
+    do
+        __atomic_store_n(&node->town[i], town[i], __ATOMIC_RELAXED);
+    while (town[i++] != '\0' && i < sizeof(node->town));
+}
+
 // Function to create a new town node
-Town* newTown(char district[], char town[], int population, int elevation, char hasMunicipality[]) {
-    Town* node = (Town*)malloc(sizeof(Town));
-    strcpy(node->district, district);
-    strcpy(node->town, town);
-    node->population = population;
-    node->elevation = elevation;
-    strcpy(node->hasMunicipality, hasMunicipality);
+Town* newTown(int districtId, char town[], int population, int elevation, int hasMunicipality) {
+    Town* node = allocTown();
+    __atomic_store_n(&node->districtId, districtId, __ATOMIC_RELAXED);
+    storeTownName(node, town);
+    __atomic_store_n(&node->population, population, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->elevation, elevation, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->hasMunicipality, (unsigned char)hasMunicipality, __ATOMIC_RELAXED);
     node->left = NULL;
     node->right = NULL;
     node->height = 1; // New node is initially added at leaf level (height = 1)
+    node->size = 1;
+    node->populationSum = population;
+    node->popLeft = NULL;
+    node->popRight = NULL;
+    node->popHeight = 1;
     return node;
 }
 
@@ -63,9 +417,9 @@ Town* rightRotate(Town *y) {
     x->right = y;
     y->left = T2;
 
-    // Update heights
-    y->height = max(height(y->left), height(y->right)) + 1;
-    x->height = max(height(x->left), height(x->right)) + 1;
+    // Update heights and subtree aggregates
+    updateTown(y);
+    updateTown(x);
 
     return x; // New root after rotation
 }
@@ -79,9 +433,9 @@ Town* leftRotate(Town *x) {
     y->left = x;
     x->right = T2;
 
-    // Update heights
-    x->height = max(height(x->left), height(x->right)) + 1;
-    y->height = max(height(y->left), height(y->right)) + 1;
+    // Update heights and subtree aggregates
+    updateTown(x);
+    updateTown(y);
 
     return y; // New root after rotation
 }
@@ -93,378 +447,5252 @@ int getBalance(Town *node) {
     return height(node->left) - height(node->right);
 }
 
-// Function to insert a town into the AVL tree
-Town* insert(Town* node, char district[], char town[], int population, int elevation, char hasMunicipality[]) {
+// Function to insert a town into the AVL tree. Sets *created to the new node,
+// or to NULL if the town was already there, so callers need no second descent.
+Town* insert(Town* node, int districtId, char town[], int population, int elevation, int hasMunicipality, Town **created) {
     if (node == NULL)
-        return newTown(district, town, population, elevation, hasMunicipality);
+        return *created = newTown(districtId, town, population, elevation, hasMunicipality);
 
     // Perform standard BST insertion
-    if (strcmp(town, node->town) < 0)
-        node->left = insert(node->left, district, town, population, elevation, hasMunicipality);
-    else if (strcmp(town, node->town) > 0)
-        node->right = insert(node->right, district, town, population, elevation, hasMunicipality);
-    else
+    int cmp = strcmp(town, node->town);
+    if (cmp < 0) {
+        node->left = insert(node->left, districtId, town, population, elevation, hasMunicipality, created);
+    } else if (cmp > 0) {
+        node->right = insert(node->right, districtId, town, population, elevation, hasMunicipality, created);
+    } else {
+        *created = NULL;
         return node; // Duplicate towns are not allowed
+    }
+    if (*created == NULL)
+        return node; // Nothing below changed
+
+    // Update height and subtree aggregates of the current node
+    updateTown(node);
+
+    // Get the balance factor to check if the node became unbalanced
+    int balance = getBalance(node);
+
+    // Left Left Case
+    if (balance > 1 && strcmp(town, node->left->town) < 0) {
+        stats.rotations[ROTATE_LEFT_LEFT]++;
+        return rightRotate(node);
+    }
+
+    // Right Right Case
+    if (balance < -1 && strcmp(town, node->right->town) > 0) {
+        stats.rotations[ROTATE_RIGHT_RIGHT]++;
+        return leftRotate(node);
+    }
+
+    // Left Right Case
+    if (balance > 1 && strcmp(town, node->left->town) > 0) {
+        stats.rotations[ROTATE_LEFT_RIGHT]++;
+        node->left = leftRotate(node->left);
+        return rightRotate(node);
+    }
+
+    // Right Left Case
+    if (balance < -1 && strcmp(town, node->right->town) < 0) {
+        stats.rotations[ROTATE_RIGHT_LEFT]++;
+        node->right = rightRotate(node->right);
+        return leftRotate(node);
+    }
+
+    return node; // Return the unchanged node pointer
+}
+
+// Function to search for a town in the AVL tree
+Town* findTown(Town* root, char town[]) {
+    if (root == NULL || strcmp(root->town, town) == 0)
+        return root;
+
+    if (strcmp(root->town, town) < 0)
+        return findTown(root->right, town);
+
+    return findTown(root->left, town);
+}
+
+// Function to restore the AVL balance of a node after one of its subtrees shrank
+Town* rebalanceTown(Town *root) {
+    // Update height and subtree aggregates of the current node
+    updateTown(root);
+
+    // Get the balance factor to check if the node became unbalanced
+    int balance = getBalance(root);
+
+    // Left Left Case
+    if (balance > 1 && getBalance(root->left) >= 0) {
+        stats.rotations[ROTATE_LEFT_LEFT]++;
+        return rightRotate(root);
+    }
+
+    // Left Right Case
+    if (balance > 1 && getBalance(root->left) < 0) {
+        stats.rotations[ROTATE_LEFT_RIGHT]++;
+        root->left = leftRotate(root->left);
+        return rightRotate(root);
+    }
+
+    // Right Right Case
+    if (balance < -1 && getBalance(root->right) <= 0) {
+        stats.rotations[ROTATE_RIGHT_RIGHT]++;
+        return leftRotate(root);
+    }
+
+    // Right Left Case
+    if (balance < -1 && getBalance(root->right) > 0) {
+        stats.rotations[ROTATE_RIGHT_LEFT]++;
+        root->right = rightRotate(root->right);
+        return leftRotate(root);
+    }
+
+    return root; // Return the balanced node
+}
+
+// Function to unlink the smallest town of a subtree, returning the new subtree root
+Town* removeMinTown(Town *root, Town **min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = removeMinTown(root->left, min);
+    return rebalanceTown(root);
+}
+
+// Function to delete a town from the AVL tree
+Town* deleteTown(Town* root, char town[]) {
+    if (root == NULL) {
+        printf("Town not found.\n");
+        return root;
+    }
+
+    // Perform standard BST delete
+    if (strcmp(town, root->town) < 0)
+        root->left = deleteTown(root->left, town);
+    else if (strcmp(town, root->town) > 0)
+        root->right = deleteTown(root->right, town);
+    else {
+        // Nodes are relinked rather than copied, so pointers held by the
+        // indexes to every other town stay valid
+        Town *removed = root;
+        if ((root->left == NULL) || (root->right == NULL)) {
+            // Node with only one child or no child: the child takes its place
+            root = root->left ? root->left : root->right;
+        } else {
+            // Node with two children: the inorder successor (smallest in the right subtree) takes its place
+            Town *successor;
+            Town *right = removeMinTown(root->right, &successor);
+            successor->left = root->left;
+            successor->right = right;
+            root = successor;
+        }
+        freeTown(removed);
+    }
+
+    // If the tree had only one node, return
+    if (root == NULL)
+        return root;
+
+    return rebalanceTown(root);
+}
+
+// Function to count the towns in position order up to a key: how many
+// names sort before `key` (or equal to it when `inclusive` is set), and
+// their total population. Runs in O(log n) using the subtree aggregates.
+void countTownsBefore(Town *root, char key[], int inclusive, int *count, long long *population) {
+    *count = 0;
+    *population = 0;
+    while (root != NULL) {
+        int cmp = strcmp(root->town, key);
+        if (cmp < 0 || (cmp == 0 && inclusive)) {
+            // This town and its whole left subtree come before the key
+            *count += subtreeSize(root->left) + 1;
+            *population += subtreePopulation(root->left) + root->population;
+            if (cmp == 0)
+                return;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+}
+
+// Function to find the alphabetical position (1-based) of a town, or 0 if it is not in the tree
+int rankTown(Town *root, char town[]) {
+    int before = 0;
+    while (root != NULL) {
+        int cmp = strcmp(town, root->town);
+        if (cmp == 0)
+            return before + subtreeSize(root->left) + 1;
+        if (cmp < 0) {
+            root = root->left;
+        } else {
+            before += subtreeSize(root->left) + 1;
+            root = root->right;
+        }
+    }
+    return 0;
+}
+
+// Function to find the k-th town (1-based) in alphabetical order, or NULL if there is none
+Town* selectTown(Town *root, int k) {
+    while (root != NULL) {
+        int leftSize = subtreeSize(root->left);
+        if (k <= leftSize) {
+            root = root->left;
+        } else if (k == leftSize + 1) {
+            return root;
+        } else {
+            k -= leftSize + 1;
+            root = root->right;
+        }
+    }
+    return NULL;
+}
+
+// Function to add a population change to every subtree sum on the path to a town
+void adjustPopulationSums(Town *root, char town[], long long delta) {
+    while (root != NULL) {
+        root->populationSum += delta;
+        int cmp = strcmp(town, root->town);
+        if (cmp == 0)
+            return;
+        root = cmp < 0 ? root->left : root->right;
+    }
+}
+
+// The population index is a second AVL tree threaded through the same Town
+// nodes with popLeft/popRight/popHeight, ordered by population and then by name
+
+// Function to get the height of a node in the population index
+int popHeight(Town *node) {
+    if (node == NULL)
+        return 0;
+    return node->popHeight;
+}
+
+// Function to get the balance factor of a node in the population index
+int popBalance(Town *node) {
+    if (node == NULL)
+        return 0;
+    return popHeight(node->popLeft) - popHeight(node->popRight);
+}
+
+// Function to order two towns by population, then by name
+int comparePopulation(Town *a, Town *b) {
+    if (a->population != b->population)
+        return (a->population > b->population) - (a->population < b->population);
+    return strcmp(a->town, b->town);
+}
+
+// Function to perform a right rotation in the population index
+Town* popRightRotate(Town *y) {
+    Town *x = y->popLeft;
+    y->popLeft = x->popRight;
+    x->popRight = y;
+    y->popHeight = max(popHeight(y->popLeft), popHeight(y->popRight)) + 1;
+    x->popHeight = max(popHeight(x->popLeft), popHeight(x->popRight)) + 1;
+    return x;
+}
+
+// Function to perform a left rotation in the population index
+Town* popLeftRotate(Town *x) {
+    Town *y = x->popRight;
+    x->popRight = y->popLeft;
+    y->popLeft = x;
+    x->popHeight = max(popHeight(x->popLeft), popHeight(x->popRight)) + 1;
+    y->popHeight = max(popHeight(y->popLeft), popHeight(y->popRight)) + 1;
+    return y;
+}
+
+// Function to restore the AVL balance of a node in the population index
+Town* popRebalance(Town *node) {
+    node->popHeight = 1 + max(popHeight(node->popLeft), popHeight(node->popRight));
+    int balance = popBalance(node);
+
+    if (balance > 1) {
+        if (popBalance(node->popLeft) < 0)
+            node->popLeft = popLeftRotate(node->popLeft);
+        return popRightRotate(node);
+    }
+    if (balance < -1) {
+        if (popBalance(node->popRight) > 0)
+            node->popRight = popRightRotate(node->popRight);
+        return popLeftRotate(node);
+    }
+    return node;
+}
+
+// Function to add a town to the population index
+Town* populationInsert(Town *root, Town *town) {
+    if (root == NULL) {
+        town->popLeft = NULL;
+        town->popRight = NULL;
+        town->popHeight = 1;
+        return town;
+    }
+
+    int cmp = comparePopulation(town, root);
+    if (cmp < 0)
+        root->popLeft = populationInsert(root->popLeft, town);
+    else if (cmp > 0)
+        root->popRight = populationInsert(root->popRight, town);
+    else
+        return root; // Already indexed
+
+    return popRebalance(root);
+}
+
+// Function to unlink the smallest town of a population subtree
+Town* populationRemoveMin(Town *root, Town **min) {
+    if (root->popLeft == NULL) {
+        *min = root;
+        return root->popRight;
+    }
+    root->popLeft = populationRemoveMin(root->popLeft, min);
+    return popRebalance(root);
+}
+
+// Function to remove a town from the population index (its population must not have changed since it was added)
+Town* populationDelete(Town *root, Town *town) {
+    if (root == NULL)
+        return NULL;
+
+    int cmp = comparePopulation(town, root);
+    if (cmp < 0) {
+        root->popLeft = populationDelete(root->popLeft, town);
+    } else if (cmp > 0) {
+        root->popRight = populationDelete(root->popRight, town);
+    } else if (root->popLeft == NULL || root->popRight == NULL) {
+        root = root->popLeft ? root->popLeft : root->popRight;
+    } else {
+        Town *successor;
+        Town *right = populationRemoveMin(root->popRight, &successor);
+        successor->popLeft = root->popLeft;
+        successor->popRight = right;
+        root = successor;
+    }
+
+    if (root == NULL)
+        return NULL;
+    return popRebalance(root);
+}
+
+// Function to build a balanced population index from towns sorted by population
+Town* buildPopulationIndex(Town **towns, int count) {
+    if (count == 0)
+        return NULL;
+
+    int mid = count / 2;
+    Town *node = towns[mid];
+    node->popLeft = buildPopulationIndex(towns, mid);
+    node->popRight = buildPopulationIndex(towns + mid + 1, count - mid - 1);
+    node->popHeight = 1 + max(popHeight(node->popLeft), popHeight(node->popRight));
+    return node;
+}
+
+// Function to order town pointers for buildPopulationIndex
+int comparePopulationPointers(const void *a, const void *b) {
+    return comparePopulation(*(Town* const*)a, *(Town* const*)b);
+}
+
+// Define a cursor over the towns in name order or in population order.
+// It keeps the path from the root to the current town on an explicit stack,
+// so it can move both ways, be seeked to a key and be abandoned at any point.
+// A cursor is invalidated by any insert or delete.
+#define CURSOR_MAX_DEPTH 64 // Far above the height of any AVL tree that fits in memory
+
+#define ORDER_BY_NAME 0       // Walk the AVL tree (left/right)
+#define ORDER_BY_POPULATION 1 // Walk the population index (popLeft/popRight)
+
+typedef struct TownCursor {
+    Town *path[CURSOR_MAX_DEPTH]; // Nodes from the root down to the current town
+    int depth;                    // Number of nodes in path, 0 once the cursor has run off either end
+    int order;                    // ORDER_BY_NAME or ORDER_BY_POPULATION
+    Town *root;                   // Root of the tree being walked
+} TownCursor;
+
+// Function to get the child on one side of a node in the cursor's tree
+static inline Town* cursorChild(TownCursor *cursor, Town *node, int right) {
+    if (cursor->order == ORDER_BY_POPULATION)
+        return right ? node->popRight : node->popLeft;
+    return right ? node->right : node->left;
+}
+
+// Function to set up a cursor over a tree without positioning it
+void cursorInit(TownCursor *cursor, Town *root, int order) {
+    cursor->depth = 0;
+    cursor->order = order;
+    cursor->root = root;
+}
+
+// Function to get the town under the cursor, or NULL past either end
+Town* cursorTown(TownCursor *cursor) {
+    return cursor->depth > 0 ? cursor->path[cursor->depth - 1] : NULL;
+}
+
+// Function to push a node and then its outermost descendants on one side
+void cursorDescend(TownCursor *cursor, Town *node, int right) {
+    while (node != NULL) {
+        cursor->path[cursor->depth++] = node;
+        node = cursorChild(cursor, node, right);
+    }
+}
+
+// Function to move the cursor to the first town
+Town* cursorFirst(TownCursor *cursor) {
+    cursor->depth = 0;
+    cursorDescend(cursor, cursor->root, 0);
+    return cursorTown(cursor);
+}
+
+// Function to move the cursor to the last town
+Town* cursorLast(TownCursor *cursor) {
+    cursor->depth = 0;
+    cursorDescend(cursor, cursor->root, 1);
+    return cursorTown(cursor);
+}
+
+// Function to step the cursor one town forwards (right = 1) or backwards (right = 0)
+Town* cursorStep(TownCursor *cursor, int right) {
+    Town *node = cursorTown(cursor);
+    if (node == NULL)
+        return NULL;
+
+    // The neighbour is the outermost node of the subtree on that side...
+    Town *child = cursorChild(cursor, node, right);
+    if (child != NULL) {
+        cursor->path[cursor->depth++] = child;
+        cursorDescend(cursor, cursorChild(cursor, child, !right), !right);
+        return cursorTown(cursor);
+    }
+
+    // ...or the first ancestor reached from the other side
+    while (--cursor->depth > 0) {
+        Town *parent = cursor->path[cursor->depth - 1];
+        if (cursorChild(cursor, parent, !right) == node)
+            return parent;
+        node = parent;
+    }
+    return NULL;
+}
+
+// Function to move the cursor to the next town
+Town* cursorNext(TownCursor *cursor) {
+    return cursorStep(cursor, 1);
+}
+
+// Function to move the cursor to the previous town
+Town* cursorPrev(TownCursor *cursor) {
+    return cursorStep(cursor, 0);
+}
+
+// Function to compare a town with a seek key in the cursor's order
+static inline int cursorCompare(TownCursor *cursor, Town *node, char town[], int population) {
+    if (cursor->order == ORDER_BY_POPULATION)
+        return (node->population > population) - (node->population < population);
+    return strcmp(node->town, town);
+}
+
+// Function to move the cursor to the first town at or after a key: a town name
+// for ORDER_BY_NAME, a population for ORDER_BY_POPULATION. Runs in O(log n).
+Town* cursorSeekKey(TownCursor *cursor, char town[], int population) {
+    int found = 0; // Path length up to the best candidate so far
+    cursor->depth = 0;
+
+    Town *node = cursor->root;
+    while (node != NULL) {
+        cursor->path[cursor->depth++] = node;
+        if (cursorCompare(cursor, node, town, population) >= 0) {
+            found = cursor->depth; // A candidate; look for a smaller one on the left
+            node = cursorChild(cursor, node, 0);
+        } else {
+            node = cursorChild(cursor, node, 1);
+        }
+    }
+
+    // The path to the best candidate is a prefix of the path walked
+    cursor->depth = found;
+    return cursorTown(cursor);
+}
+
+// Function to move a name-ordered cursor to the first town whose name is at or after `town`
+Town* cursorSeek(TownCursor *cursor, char town[]) {
+    return cursorSeekKey(cursor, town, 0);
+}
+
+// Function to move a population-ordered cursor to the first town with at least `population` people
+Town* cursorSeekPopulation(TownCursor *cursor, int population) {
+    return cursorSeekKey(cursor, NULL, population);
+}
+
+// Function to collect every town of the AVL tree into an array
+void collectTowns(Town *root, Town **towns, int *count) {
+    TownCursor cursor;
+    cursorInit(&cursor, root, ORDER_BY_NAME);
+    for (Town *node = cursorFirst(&cursor); node != NULL; node = cursorNext(&cursor))
+        towns[(*count)++] = node;
+}
+
+// Define the B+-tree name index, a cache-conscious alternative to the AVL
+// tree for lookups and ordered scans. Each node holds up to BTREE_ORDER keys,
+// and for each key the first 8 bytes of the name are stored inline as a
+// big-endian integer. Most comparisons are then integer compares on a few
+// contiguous cache lines, and a name is only read on a prefix tie. Towns live
+// in the leaves, which are linked in name order. Internal nodes hold their
+// own copies of the separator names, so deleting a town never leaves a
+// separator pointing at freed memory.
+#define BTREE_ORDER 16              // Most keys in a node
+#define BTREE_MIN (BTREE_ORDER / 2) // Fewest keys in a node other than the root
+
+typedef struct BTreeNode {
+    int count;                      // Keys in the node
+    int leaf;                       // 1 for leaves, 0 for internal nodes
+    uint64_t prefixes[BTREE_ORDER]; // First 8 bytes of each key's name, big-endian and zero padded
+    union {
+        Town *towns[BTREE_ORDER];      // Leaves: the towns, in name order
+        char *separators[BTREE_ORDER]; // Internal nodes: a name at or below every name in children[i + 1]
+    };
+    struct BTreeNode *children[BTREE_ORDER + 1]; // Internal nodes only
+    struct BTreeNode *prev;         // Leaves only: previous leaf in name order
+    struct BTreeNode *next;         // Leaves only: next leaf in name order
+} BTreeNode;
+
+#define BTREE_NODE_BYTES ((sizeof(BTreeNode) + 63) & ~(size_t)63) // Node size rounded up to whole cache lines
+
+typedef struct BTree {
+    BTreeNode *root; // NULL while the tree is empty
+    int count;       // Number of towns
+    int height;      // Levels from the root down to the leaves
+    long nodes;      // Nodes allocated
+} BTree;
+
+// Define a position in the leaves of a B+-tree
+typedef struct BTreeCursor {
+    BTreeNode *leaf; // Leaf holding the current town, NULL once the cursor has run off either end
+    int index;       // Position of the town in the leaf
+} BTreeCursor;
+
+// Function to pack the first 8 bytes of a name into an integer that orders like the name
+static inline uint64_t namePrefix(const char *name) {
+    uint64_t prefix = 0;
+    memcpy(&prefix, name, strnlen(name, 8));
+    return __builtin_bswap64(prefix);
+}
+
+// Function to compare a name with a node key, given both prefixes
+static inline int compareKey(uint64_t prefix, const char *name, uint64_t keyPrefix, const char *key) {
+    if (prefix != keyPrefix)
+        return prefix < keyPrefix ? -1 : 1;
+    if ((prefix & 0xff) == 0)
+        return 0; // Both names end within the prefix
+    return strcmp(name + 8, key + 8);
+}
+
+// Function to get the name of key i of a node
+static inline const char* btreeKey(BTreeNode *node, int i) {
+    return node->leaf ? node->towns[i]->town : node->separators[i];
+}
+
+// Function to count the keys of a node that sort before a name, or at or before it when `upper` is set
+static inline int btreeRank(BTreeNode *node, uint64_t prefix, const char *name, int upper) {
+    int i = 0;
+    while (i < node->count && node->prefixes[i] < prefix)
+        i++; // Most keys are settled by their prefix alone
+    while (i < node->count) {
+        int cmp = compareKey(prefix, name, node->prefixes[i], btreeKey(node, i));
+        if (cmp < 0 || (cmp == 0 && !upper))
+            break;
+        i++;
+    }
+    return i;
+}
+
+// Function to allocate an empty node aligned to a cache line
+BTreeNode* newBTreeNode(BTree *tree, int leaf) {
+    BTreeNode *node = (BTreeNode*)aligned_alloc(64, BTREE_NODE_BYTES);
+    if (node == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    memset(node, 0, sizeof(*node));
+    node->leaf = leaf;
+    tree->nodes++;
+    return node;
+}
+
+// Function to make a separator that a node owns
+char* copySeparator(const char *name) {
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    return copy;
+}
+
+// Function to find a town in the B+-tree
+Town* btreeFind(BTree *tree, const char *town) {
+    BTreeNode *node = tree->root;
+    if (node == NULL)
+        return NULL;
+    uint64_t prefix = namePrefix(town);
+    while (!node->leaf)
+        node = node->children[btreeRank(node, prefix, town, 1)];
+    int i = btreeRank(node, prefix, town, 0);
+    if (i < node->count && compareKey(prefix, town, node->prefixes[i], node->towns[i]->town) == 0)
+        return node->towns[i];
+    return NULL;
+}
+
+// Function to insert a town below a node. If the node had to split, *right
+// gets the new right half and *separator/*separatorPrefix the key that
+// divides them. Returns 0 if the town was already there.
+int btreeInsertInto(BTree *tree, BTreeNode *node, uint64_t prefix, Town *town,
+                    BTreeNode **right, char **separator, uint64_t *separatorPrefix) {
+    *right = NULL;
+    uint64_t prefixes[BTREE_ORDER + 1];
+    void *keys[BTREE_ORDER + 1];
+    BTreeNode *children[BTREE_ORDER + 2];
+
+    if (node->leaf) {
+        int i = btreeRank(node, prefix, town->town, 0);
+        if (i < node->count && compareKey(prefix, town->town, node->prefixes[i], node->towns[i]->town) == 0)
+            return 0;
+        if (node->count < BTREE_ORDER) {
+            memmove(&node->prefixes[i + 1], &node->prefixes[i], (node->count - i) * sizeof(uint64_t));
+            memmove(&node->towns[i + 1], &node->towns[i], (node->count - i) * sizeof(Town*));
+            node->prefixes[i] = prefix;
+            node->towns[i] = town;
+            node->count++;
+            return 1;
+        }
+
+        // Split a full leaf: the lower half stays, the upper half moves to a new leaf
+        for (int j = 0, k = 0; j <= BTREE_ORDER; j++) {
+            prefixes[j] = j == i ? prefix : node->prefixes[k];
+            keys[j] = j == i ? (void*)town : (void*)node->towns[k++];
+        }
+        BTreeNode *sibling = newBTreeNode(tree, 1);
+        int keep = (BTREE_ORDER + 1) / 2;
+        node->count = keep;
+        sibling->count = BTREE_ORDER + 1 - keep;
+        for (int j = 0; j <= BTREE_ORDER; j++) {
+            BTreeNode *target = j < keep ? node : sibling;
+            int at = j < keep ? j : j - keep;
+            target->prefixes[at] = prefixes[j];
+            target->towns[at] = (Town*)keys[j];
+        }
+        sibling->prev = node;
+        sibling->next = node->next;
+        if (node->next != NULL)
+            node->next->prev = sibling;
+        node->next = sibling;
+
+        *right = sibling;
+        *separator = copySeparator(sibling->towns[0]->town);
+        *separatorPrefix = sibling->prefixes[0];
+        return 1;
+    }
+
+    int i = btreeRank(node, prefix, town->town, 1);
+    BTreeNode *childRight;
+    char *childSeparator;
+    uint64_t childPrefix;
+    if (!btreeInsertInto(tree, node->children[i], prefix, town, &childRight, &childSeparator, &childPrefix))
+        return 0;
+    if (childRight == NULL)
+        return 1;
+
+    // The child split: its separator and new right half go in after it
+    if (node->count < BTREE_ORDER) {
+        memmove(&node->prefixes[i + 1], &node->prefixes[i], (node->count - i) * sizeof(uint64_t));
+        memmove(&node->separators[i + 1], &node->separators[i], (node->count - i) * sizeof(char*));
+        memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i) * sizeof(BTreeNode*));
+        node->prefixes[i] = childPrefix;
+        node->separators[i] = childSeparator;
+        node->children[i + 1] = childRight;
+        node->count++;
+        return 1;
+    }
+
+    // Split a full internal node: the middle separator moves up
+    for (int j = 0, k = 0; j <= BTREE_ORDER; j++) {
+        prefixes[j] = j == i ? childPrefix : node->prefixes[k];
+        keys[j] = j == i ? (void*)childSeparator : (void*)node->separators[k++];
+    }
+    for (int j = 0, k = 0; j <= BTREE_ORDER + 1; j++)
+        children[j] = j == i + 1 ? childRight : node->children[k++];
+
+    BTreeNode *sibling = newBTreeNode(tree, 0);
+    int middle = (BTREE_ORDER + 1) / 2;
+    node->count = middle;
+    for (int j = 0; j < middle; j++) {
+        node->prefixes[j] = prefixes[j];
+        node->separators[j] = (char*)keys[j];
+        node->children[j] = children[j];
+    }
+    node->children[middle] = children[middle];
+    sibling->count = BTREE_ORDER - middle;
+    for (int j = 0; j < sibling->count; j++) {
+        sibling->prefixes[j] = prefixes[middle + 1 + j];
+        sibling->separators[j] = (char*)keys[middle + 1 + j];
+        sibling->children[j] = children[middle + 1 + j];
+    }
+    sibling->children[sibling->count] = children[BTREE_ORDER + 1];
+
+    *right = sibling;
+    *separator = (char*)keys[middle];
+    *separatorPrefix = prefixes[middle];
+    return 1;
+}
+
+// Function to add a town to the B+-tree; returns 0 if it was already there
+int btreeInsert(BTree *tree, Town *town) {
+    if (tree->root == NULL) {
+        tree->root = newBTreeNode(tree, 1);
+        tree->height = 1;
+    }
+
+    BTreeNode *right;
+    char *separator;
+    uint64_t separatorPrefix;
+    if (!btreeInsertInto(tree, tree->root, namePrefix(town->town), town, &right, &separator, &separatorPrefix))
+        return 0;
+
+    // A split root gets a new root above it
+    if (right != NULL) {
+        BTreeNode *root = newBTreeNode(tree, 0);
+        root->count = 1;
+        root->prefixes[0] = separatorPrefix;
+        root->separators[0] = separator;
+        root->children[0] = tree->root;
+        root->children[1] = right;
+        tree->root = root;
+        tree->height++;
+    }
+    tree->count++;
+    return 1;
+}
+
+// Function to release a node
+void freeBTreeNode(BTree *tree, BTreeNode *node) {
+    free(node);
+    tree->nodes--;
+}
+
+// Function to refill child i of an internal node that dropped below BTREE_MIN
+// keys, by borrowing a key from a sibling or by merging with one
+void btreeFixChild(BTree *tree, BTreeNode *parent, int i) {
+    BTreeNode *child = parent->children[i];
+    BTreeNode *left = i > 0 ? parent->children[i - 1] : NULL;
+    BTreeNode *right = i < parent->count ? parent->children[i + 1] : NULL;
+
+    if (left != NULL && left->count > BTREE_MIN) {
+        // Borrow the last key of the left sibling
+        memmove(&child->prefixes[1], &child->prefixes[0], child->count * sizeof(uint64_t));
+        memmove(&child->towns[1], &child->towns[0], child->count * sizeof(Town*)); // Moves separators too
+        if (child->leaf) {
+            child->prefixes[0] = left->prefixes[left->count - 1];
+            child->towns[0] = left->towns[left->count - 1];
+            free(parent->separators[i - 1]);
+            parent->separators[i - 1] = copySeparator(child->towns[0]->town);
+            parent->prefixes[i - 1] = child->prefixes[0];
+        } else {
+            memmove(&child->children[1], &child->children[0], (child->count + 1) * sizeof(BTreeNode*));
+            child->prefixes[0] = parent->prefixes[i - 1];
+            child->separators[0] = parent->separators[i - 1];
+            child->children[0] = left->children[left->count];
+            parent->prefixes[i - 1] = left->prefixes[left->count - 1];
+            parent->separators[i - 1] = left->separators[left->count - 1];
+        }
+        left->count--;
+        child->count++;
+        return;
+    }
+
+    if (right != NULL && right->count > BTREE_MIN) {
+        // Borrow the first key of the right sibling
+        if (child->leaf) {
+            child->prefixes[child->count] = right->prefixes[0];
+            child->towns[child->count] = right->towns[0];
+        } else {
+            child->prefixes[child->count] = parent->prefixes[i];
+            child->separators[child->count] = parent->separators[i];
+            child->children[child->count + 1] = right->children[0];
+            parent->prefixes[i] = right->prefixes[0];
+            parent->separators[i] = right->separators[0];
+            memmove(&right->children[0], &right->children[1], right->count * sizeof(BTreeNode*));
+        }
+        child->count++;
+        right->count--;
+        memmove(&right->prefixes[0], &right->prefixes[1], right->count * sizeof(uint64_t));
+        memmove(&right->towns[0], &right->towns[1], right->count * sizeof(Town*));
+        if (child->leaf) {
+            free(parent->separators[i]);
+            parent->separators[i] = copySeparator(right->towns[0]->town);
+            parent->prefixes[i] = right->prefixes[0];
+        }
+        return;
+    }
+
+    // Neither sibling can spare a key: merge the child with one of them
+    int s = left != NULL ? i - 1 : i; // Separator between the two nodes being merged
+    BTreeNode *into = parent->children[s], *from = parent->children[s + 1];
+    if (into->leaf) {
+        free(parent->separators[s]);
+        memcpy(&into->prefixes[into->count], from->prefixes, from->count * sizeof(uint64_t));
+        memcpy(&into->towns[into->count], from->towns, from->count * sizeof(Town*));
+        into->count += from->count;
+        into->next = from->next;
+        if (from->next != NULL)
+            from->next->prev = into;
+    } else {
+        into->prefixes[into->count] = parent->prefixes[s];
+        into->separators[into->count] = parent->separators[s];
+        into->count++;
+        memcpy(&into->prefixes[into->count], from->prefixes, from->count * sizeof(uint64_t));
+        memcpy(&into->separators[into->count], from->separators, from->count * sizeof(char*));
+        memcpy(&into->children[into->count], from->children, (from->count + 1) * sizeof(BTreeNode*));
+        into->count += from->count;
+    }
+    freeBTreeNode(tree, from);
+
+    memmove(&parent->prefixes[s], &parent->prefixes[s + 1], (parent->count - s - 1) * sizeof(uint64_t));
+    memmove(&parent->separators[s], &parent->separators[s + 1], (parent->count - s - 1) * sizeof(char*));
+    memmove(&parent->children[s + 1], &parent->children[s + 2], (parent->count - s - 1) * sizeof(BTreeNode*));
+    parent->count--;
+}
+
+// Function to remove a town from below a node; returns it, or NULL if it is not there
+Town* btreeDeleteFrom(BTree *tree, BTreeNode *node, uint64_t prefix, const char *town) {
+    if (node->leaf) {
+        int i = btreeRank(node, prefix, town, 0);
+        if (i == node->count || compareKey(prefix, town, node->prefixes[i], node->towns[i]->town) != 0)
+            return NULL;
+        Town *removed = node->towns[i];
+        memmove(&node->prefixes[i], &node->prefixes[i + 1], (node->count - i - 1) * sizeof(uint64_t));
+        memmove(&node->towns[i], &node->towns[i + 1], (node->count - i - 1) * sizeof(Town*));
+        node->count--;
+        return removed;
+    }
+
+    // Separators may outlive the towns they were copied from; they only have to keep dividing the children
+    int i = btreeRank(node, prefix, town, 1);
+    Town *removed = btreeDeleteFrom(tree, node->children[i], prefix, town);
+    if (removed != NULL && node->children[i]->count < BTREE_MIN)
+        btreeFixChild(tree, node, i);
+    return removed;
+}
+
+// Function to remove a town from the B+-tree; returns it, or NULL if it is not there
+Town* btreeDelete(BTree *tree, const char *town) {
+    if (tree->root == NULL)
+        return NULL;
+    Town *removed = btreeDeleteFrom(tree, tree->root, namePrefix(town), town);
+    if (removed == NULL)
+        return NULL;
+    tree->count--;
+
+    // Shrink the tree when the root runs out of keys
+    BTreeNode *root = tree->root;
+    if (root->count == 0) {
+        tree->root = root->leaf ? NULL : root->children[0];
+        tree->height--;
+        freeBTreeNode(tree, root);
+    }
+    return removed;
+}
+
+// Function to build a B+-tree bottom-up from towns sorted by name, with full
+// leaves, so loading costs one pass instead of one descent per town
+void btreeBuild(BTree *tree, Town **towns, int count) {
+    if (count == 0)
+        return;
+
+    // Spread the towns evenly over the fewest leaves that hold them
+    int nodeCount = (count + BTREE_ORDER - 1) / BTREE_ORDER;
+    BTreeNode **level = (BTreeNode**)malloc(nodeCount * sizeof(BTreeNode*));
+    Town **lowest = (Town**)malloc(nodeCount * sizeof(Town*)); // Smallest town below each node
+    if (level == NULL || lowest == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    for (int n = 0, next = 0; n < nodeCount; n++) {
+        BTreeNode *leaf = newBTreeNode(tree, 1);
+        leaf->count = count / nodeCount + (n < count % nodeCount);
+        for (int j = 0; j < leaf->count; j++) {
+            leaf->towns[j] = towns[next++];
+            leaf->prefixes[j] = namePrefix(leaf->towns[j]->town);
+        }
+        leaf->prev = n > 0 ? level[n - 1] : NULL;
+        if (n > 0)
+            level[n - 1]->next = leaf;
+        level[n] = leaf;
+        lowest[n] = leaf->towns[0];
+    }
+    tree->height = 1;
+
+    // Group the nodes of each level under parents until one is left
+    while (nodeCount > 1) {
+        int parents = (nodeCount + BTREE_ORDER) / (BTREE_ORDER + 1);
+        for (int p = 0, next = 0; p < parents; p++) {
+            BTreeNode *parent = newBTreeNode(tree, 0);
+            int children = nodeCount / parents + (p < nodeCount % parents);
+            Town *first = lowest[next];
+            for (int j = 0; j < children; j++, next++) {
+                parent->children[j] = level[next];
+                if (j > 0) {
+                    parent->separators[j - 1] = copySeparator(lowest[next]->town);
+                    parent->prefixes[j - 1] = namePrefix(lowest[next]->town);
+                }
+            }
+            parent->count = children - 1;
+            level[p] = parent;
+            lowest[p] = first;
+        }
+        nodeCount = parents;
+        tree->height++;
+    }
+
+    tree->root = level[0];
+    tree->count = count;
+    free(level);
+    free(lowest);
+}
+
+// Function to free every node of a subtree and the separators they own
+void freeBTreeNodes(BTree *tree, BTreeNode *node) {
+    if (!node->leaf) {
+        for (int i = 0; i <= node->count; i++)
+            freeBTreeNodes(tree, node->children[i]);
+        for (int i = 0; i < node->count; i++)
+            free(node->separators[i]);
+    }
+    freeBTreeNode(tree, node);
+}
+
+// Function to release a B+-tree; the towns themselves are left alone
+void freeBTree(BTree *tree) {
+    if (tree->root != NULL)
+        freeBTreeNodes(tree, tree->root);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// Function to get the town under a B+-tree cursor, or NULL past either end
+Town* btreeCursorTown(BTreeCursor *cursor) {
+    return cursor->leaf != NULL ? cursor->leaf->towns[cursor->index] : NULL;
+}
+
+// Function to move a cursor to the first town whose name is at or after `town`,
+// or to the first town of all when `town` is NULL
+Town* btreeSeek(BTree *tree, BTreeCursor *cursor, const char *town) {
+    BTreeNode *node = tree->root;
+    cursor->leaf = NULL;
+    if (node == NULL)
+        return NULL;
+
+    uint64_t prefix = town != NULL ? namePrefix(town) : 0;
+    while (!node->leaf)
+        node = town != NULL ? node->children[btreeRank(node, prefix, town, 1)] : node->children[0];
+    int i = town != NULL ? btreeRank(node, prefix, town, 0) : 0;
+
+    // The first town at or after the key may open the next leaf
+    if (i == node->count) {
+        node = node->next;
+        i = 0;
+    }
+    cursor->leaf = node;
+    cursor->index = i;
+    return btreeCursorTown(cursor);
+}
+
+// Function to move a cursor to the last town
+Town* btreeLast(BTree *tree, BTreeCursor *cursor) {
+    BTreeNode *node = tree->root;
+    cursor->leaf = NULL;
+    if (node == NULL)
+        return NULL;
+    while (!node->leaf)
+        node = node->children[node->count];
+    cursor->leaf = node;
+    cursor->index = node->count - 1;
+    return btreeCursorTown(cursor);
+}
+
+// Function to move a cursor to the next town
+Town* btreeNext(BTreeCursor *cursor) {
+    if (cursor->leaf != NULL && ++cursor->index == cursor->leaf->count) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->index = 0;
+    }
+    return btreeCursorTown(cursor);
+}
+
+// Function to move a cursor to the previous town
+Town* btreePrev(BTreeCursor *cursor) {
+    if (cursor->leaf != NULL && --cursor->index < 0) {
+        cursor->leaf = cursor->leaf->prev;
+        cursor->index = cursor->leaf != NULL ? cursor->leaf->count - 1 : 0;
+    }
+    return btreeCursorTown(cursor);
+}
+
+// Function to publish the current slot arrays to lock-free readers. The view
+// they replace is retired, as readers may still be holding it.
+void publishHashTableView(HashTable *table) {
+    HashTableView *view = (HashTableView*)malloc(sizeof(HashTableView));
+    if (view == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    view->entries = table->entries;
+    view->capacity = table->capacity;
+    view->oldEntries = table->oldEntries;
+    view->oldCapacity = table->oldCapacity;
+
+    HashTableView *previous = atomic_exchange_explicit(&table->view, view, memory_order_release);
+    if (previous != NULL)
+        retireMemory(previous);
+}
+
+// Function to create a hash table
+HashTable* createHashTable(int initialCapacity, double maxLoadFactor) {
+    HashTable *table = (HashTable*)malloc(sizeof(HashTable));
+    if (table == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+
+    // Round the capacity up to a power of two so indexes can be masked
+    int capacity = 1;
+    while (capacity < initialCapacity)
+        capacity *= 2;
+
+    table->entries = (HashTableEntry*)calloc(capacity, sizeof(HashTableEntry)); // All slots start empty
+    if (table->entries == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    table->capacity = capacity;
+    table->used = 0;
+    table->tombstones = 0;
+    table->oldEntries = NULL;
+    table->oldCapacity = 0;
+    table->migrateIndex = 0;
+    table->count = 0;
+    table->maxLoadFactor = (maxLoadFactor > 0 && maxLoadFactor < 1) ? maxLoadFactor : HASH_MAX_LOAD_FACTOR;
+    table->resizeCount = 0;
+    table->compactionCount = 0;
+    atomic_init(&table->view, NULL);
+    publishHashTableView(table);
+    return table;
+}
+
+static uint64_t hashSeed; // Per-process seed mixed into every town-name hash
+
+// Function to scramble a 64-bit value so every input bit affects every output bit
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Function to pick a fresh hash seed for this process
+void initHashSeed(void) {
+    uint64_t seed = (uint64_t)time(NULL);
+    seed ^= (uint64_t)getpid() << 32;
+    seed ^= (uint64_t)(uintptr_t)&seed; // Address space randomization adds more entropy
+    hashSeed = mix64(seed);
+}
+
+// Function to rotate a 64-bit value left
+static inline uint64_t rotl64(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Hash function to compute the hash value for a town name
+unsigned int hash(char *town) {
+    const unsigned char *p = (const unsigned char*)town;
+    size_t length = strlen(town);
+    uint64_t a = hashSeed ^ (length * 0x9e3779b97f4a7c15ULL);
+    uint64_t b = rotl64(hashSeed, 32) + 0x632be59bd9b4e019ULL;
+    uint64_t w0, w1;
+
+    // Two independent lanes consume 16 bytes per step
+    while (length >= 16) {
+        memcpy(&w0, p, 8);
+        memcpy(&w1, p + 8, 8);
+        a = rotl64((a ^ w0) * 0x87c37b91114253d5ULL, 31);
+        b = rotl64((b ^ w1) * 0x4cf5ad432745937fULL, 29);
+        p += 16;
+        length -= 16;
+    }
+    if (length >= 8) {
+        memcpy(&w0, p, 8);
+        a = rotl64((a ^ w0) * 0x87c37b91114253d5ULL, 31);
+        p += 8;
+        length -= 8;
+    }
+    if (length > 0) {
+        w1 = 0;
+        memcpy(&w1, p, length); // Remaining 1-7 bytes, zero padded
+        b = rotl64((b ^ w1) * 0x4cf5ad432745937fULL, 29);
+    }
+
+    return (unsigned int)mix64(a ^ rotl64(b, 17)); // Callers mask the value down to the table capacity
+}
+
+// Function to find a town in one slot array, counting the slots probed on the way
+HashTableEntry* probeEntries(HashTableEntry *entries, int capacity, char *town, unsigned int hashValue, int *collisions) {
+    unsigned int mask = capacity - 1;
+    unsigned int index = hashValue & mask;
+
+    // Linear probing until an empty slot ends the chain
+    for (int probed = 0; probed < capacity && entries[index].isOccupied != SLOT_EMPTY; probed++) {
+        if (entries[index].isOccupied == SLOT_OCCUPIED && entries[index].hashValue == hashValue &&
+            strcmp(entries[index].townData->town, town) == 0)
+            return &entries[index];
+        if (collisions != NULL)
+            (*collisions)++;
+        index = (index + 1) & mask;
+    }
+    return NULL;
+}
+
+// Function to find the entry of a town, looking in the slots that are still being migrated too
+HashTableEntry* probeHashTable(HashTable *table, char *town, unsigned int hashValue, int *collisions) {
+    HashTableEntry *entry = probeEntries(table->entries, table->capacity, town, hashValue, collisions);
+    if (entry == NULL && table->oldEntries != NULL)
+        entry = probeEntries(table->oldEntries, table->oldCapacity, town, hashValue, collisions);
+    return entry;
+}
+
+// Function to get the histogram bucket of a collision count:
+// buckets 0-3 are exact, the rest cover 4-7, 8-15, 16-31, ...
+int collisionBucket(int collisions, int buckets) {
+    int bucket = collisions;
+    if (collisions >= 4) {
+        bucket = 2;
+        for (int c = collisions; c > 1; c >>= 1)
+            bucket++;
+    }
+    return bucket < buckets ? bucket : buckets - 1;
+}
+
+// Function to find the entry of a town, adding the probes it took to the runtime counters
+HashTableEntry* findHashEntry(HashTable *table, char *town, unsigned int hashValue, int *collisions) {
+    int probed = 0;
+    HashTableEntry *entry = probeHashTable(table, town, hashValue, &probed);
+    stats.probes[collisionBucket(probed, PROBE_BUCKETS)]++;
+    if (collisions != NULL)
+        *collisions += probed;
+    return entry;
+}
+
+#define MULTIGET_GROUP 16 // Lookups whose probe chains are walked side by side
+
+// States of one lookup in multiGetHashTable
+#define MULTIGET_SLOT 0 // Its next slot has been prefetched
+#define MULTIGET_NAME 1 // A slot with its hash was found and the town name prefetched
+#define MULTIGET_DONE 2
+
+// Function to look up many towns at once. The lookups are taken MULTIGET_GROUP
+// at a time and their probe chains are walked side by side: each step
+// prefetches the slot or town name that lookup needs next, then moves on to
+// the next lookup, so the cache misses of a whole group overlap instead of
+// being paid one after another. results[i] is NULL for towns that are missing.
+void multiGetHashTable(HashTable *table, char *towns[], const unsigned int hashValues[], int count, Town *results[]) {
+    // While a resize is moving slots a town may be in either array; look the towns up one by one
+    if (table->oldEntries != NULL) {
+        for (int i = 0; i < count; i++) {
+            HashTableEntry *entry = findHashEntry(table, towns[i], hashValues[i], NULL);
+            results[i] = entry != NULL ? entry->townData : NULL;
+        }
+        return;
+    }
+
+    HashTableEntry *entries = table->entries;
+    unsigned int mask = table->capacity - 1;
+    for (int base = 0; base < count; base += MULTIGET_GROUP) {
+        int n = count - base < MULTIGET_GROUP ? count - base : MULTIGET_GROUP;
+        unsigned int index[MULTIGET_GROUP];
+        int probed[MULTIGET_GROUP], state[MULTIGET_GROUP];
+        for (int i = 0; i < n; i++) {
+            index[i] = hashValues[base + i] & mask;
+            probed[i] = 0;
+            state[i] = MULTIGET_SLOT;
+            results[base + i] = NULL;
+            __builtin_prefetch(&entries[index[i]]);
+        }
+
+        for (int pending = n; pending > 0;) {
+            for (int i = 0; i < n; i++) {
+                HashTableEntry *entry = &entries[index[i]];
+                if (state[i] == MULTIGET_DONE)
+                    continue;
+                if (state[i] == MULTIGET_SLOT) {
+                    if (entry->isOccupied == SLOT_EMPTY || probed[i] == table->capacity) {
+                        state[i] = MULTIGET_DONE; // The chain ended without the town
+                        stats.probes[collisionBucket(probed[i], PROBE_BUCKETS)]++;
+                        pending--;
+                        continue;
+                    }
+                    if (entry->isOccupied == SLOT_OCCUPIED && entry->hashValue == hashValues[base + i]) {
+                        state[i] = MULTIGET_NAME; // Compare the names on the next pass
+                        __builtin_prefetch(entry->townData->town);
+                        continue;
+                    }
+                } else if (strcmp(entry->townData->town, towns[base + i]) == 0) {
+                    results[base + i] = entry->townData;
+                    state[i] = MULTIGET_DONE;
+                    stats.probes[collisionBucket(probed[i], PROBE_BUCKETS)]++;
+                    pending--;
+                    continue;
+                }
+
+                // Not this slot: prefetch the next one of the chain
+                state[i] = MULTIGET_SLOT;
+                probed[i]++;
+                index[i] = (index[i] + 1) & mask;
+                __builtin_prefetch(&entries[index[i]]);
+            }
+        }
+    }
+}
+
+// Function to store a town in a free slot (empty or a tombstone)
+void fillEntry(HashTable *table, HashTableEntry *entry, Town *townData, unsigned int hashValue) {
+    if (entry->isOccupied == SLOT_EMPTY)
+        table->used++; // Reusing a tombstone does not lengthen any chain
+    else
+        table->tombstones--;
+    // Lock-free readers load slot fields with relaxed atomics, so they are stored the same way
+    __atomic_store_n(&entry->townData, townData, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->hashValue, hashValue, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->isOccupied, SLOT_OCCUPIED, __ATOMIC_RELAXED);
+}
+
+// Function to place an entry in the first free slot of its probe chain
+void placeEntry(HashTable *table, Town *townData, unsigned int hashValue) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int index = hashValue & mask;
+
+    while (table->entries[index].isOccupied == SLOT_OCCUPIED)
+        index = (index + 1) & mask;
+    fillEntry(table, &table->entries[index], townData, hashValue);
+}
+
+// Function to move up to `steps` old slots into the resized table
+void migrateHashTable(HashTable *table, int steps) {
+    while (table->oldEntries != NULL && steps-- > 0) {
+        HashTableEntry *old = &table->oldEntries[table->migrateIndex];
+        if (old->isOccupied == SLOT_OCCUPIED) {
+            placeEntry(table, old->townData, old->hashValue);
+            __atomic_store_n(&old->isOccupied, SLOT_DELETED, __ATOMIC_RELAXED); // Keep the old probe chains intact for lookups
+        }
+
+        // Release the old slots once every one of them has been moved;
+        // lock-free readers may still be probing them, so they are retired
+        // after a view without them has been published
+        if (++table->migrateIndex == table->oldCapacity) {
+            HashTableEntry *oldEntries = table->oldEntries;
+            table->oldEntries = NULL;
+            table->oldCapacity = 0;
+            table->migrateIndex = 0;
+            publishHashTableView(table);
+            retireMemory(oldEntries);
+        }
+    }
+}
+
+// Function to start an incremental rebuild into an array of the given capacity
+void resizeHashTable(HashTable *table, int newCapacity) {
+    // Finish any resize that is still in progress first
+    migrateHashTable(table, table->oldCapacity);
+
+    HashTableEntry *entries = (HashTableEntry*)calloc(newCapacity, sizeof(HashTableEntry));
+    if (entries == NULL) {
+        printf("Memory allocation failed!\n");
+        return; // Keep using the current slots
+    }
+
+    table->oldEntries = table->entries;
+    table->oldCapacity = table->capacity;
+    table->migrateIndex = 0;
+    if (newCapacity == table->capacity)
+        table->compactionCount++; // Same size, the rebuild only drops tombstones
+    else
+        table->resizeCount++;
+    table->entries = entries;
+    table->capacity = newCapacity;
+    table->used = 0;
+    table->tombstones = 0;
+    publishHashTableView(table);
+}
+
+// Function to make room for `count` towns without any later resize
+void reserveHashTable(HashTable *table, int count) {
+    if (count <= table->capacity * table->maxLoadFactor)
+        return;
+
+    int capacity = table->capacity;
+    while (count > capacity * table->maxLoadFactor)
+        capacity *= 2;
+    resizeHashTable(table, capacity);
+    migrateHashTable(table, table->oldCapacity); // Move everything across right away
+}
+
+// Function to insert a town into the hash table
+void insertIntoHashTable(HashTable *table, Town *townData) {
+    unsigned int hashValue = hash(townData->town); // Compute the hash value
+
+    migrateHashTable(table, HASH_MIGRATE_STEP);
+
+    // Rebuild before the new entry could push the table past its load factor.
+    // When most used slots are tombstones a same-size rebuild is enough.
+    if (table->used + 1 > table->capacity * table->maxLoadFactor) {
+        int grow = table->count + 1 > table->capacity * table->maxLoadFactor / 2;
+        resizeHashTable(table, grow ? table->capacity * 2 : table->capacity);
+    }
+
+    // One walk of the probe chain finds either the town or the first free slot for it
+    unsigned int mask = table->capacity - 1;
+    unsigned int index = hashValue & mask;
+    HashTableEntry *slot = NULL;
+    int probed = 0;
+    for (; probed < table->capacity && table->entries[index].isOccupied != SLOT_EMPTY; probed++) {
+        HashTableEntry *entry = &table->entries[index];
+        if (entry->isOccupied == SLOT_DELETED) {
+            if (slot == NULL)
+                slot = entry;
+        } else if (entry->hashValue == hashValue && strcmp(entry->townData->town, townData->town) == 0) {
+            slot = entry;
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    stats.probes[collisionBucket(probed, PROBE_BUCKETS)]++;
+
+    // A town that is already indexed only gets its data pointer refreshed;
+    // while a resize is in progress it may still sit in the old slots
+    HashTableEntry *existing = slot != NULL && slot->isOccupied == SLOT_OCCUPIED ? slot : NULL;
+    if (existing == NULL && table->oldEntries != NULL)
+        existing = probeEntries(table->oldEntries, table->oldCapacity, townData->town, hashValue, NULL);
+    if (existing != NULL) {
+        __atomic_store_n(&existing->townData, townData, __ATOMIC_RELAXED);
+        return;
+    }
+
+    fillEntry(table, slot != NULL ? slot : &table->entries[index], townData, hashValue);
+    table->count++;
+}
+
+// Function to delete a town from the hash table; returns the town it pointed
+// to, or NULL if it was not found
+Town* deleteFromHashTable(HashTable *table, char *town) {
+    migrateHashTable(table, HASH_MIGRATE_STEP);
+
+    HashTableEntry *entry = findHashEntry(table, town, hash(town), NULL);
+    if (entry == NULL)
+        return NULL;
+    Town *townData = entry->townData;
+
+    // Leave a tombstone so towns that collided past this slot can still be found
+    __atomic_store_n(&entry->isOccupied, SLOT_DELETED, __ATOMIC_RELAXED);
+    table->count--;
+
+    if (entry >= table->entries && entry < table->entries + table->capacity) {
+        unsigned int mask = table->capacity - 1;
+        unsigned int index = entry - table->entries;
+        table->tombstones++;
+
+        // A tombstone right before an empty slot ends its chain anyway, so
+        // sweep backwards and turn the trailing run of tombstones into empty slots
+        if (table->entries[(index + 1) & mask].isOccupied == SLOT_EMPTY) {
+            while (table->entries[index].isOccupied == SLOT_DELETED) {
+                __atomic_store_n(&table->entries[index].isOccupied, SLOT_EMPTY, __ATOMIC_RELAXED);
+                table->used--;
+                table->tombstones--;
+                index = (index - 1) & mask;
+            }
+        }
+
+        // Too many tombstones left behind: compact them away incrementally
+        if (table->oldEntries == NULL && table->tombstones > table->capacity * HASH_MAX_TOMBSTONES)
+            resizeHashTable(table, table->capacity);
+    }
+
+    return townData;
+}
+
+// Define the structure for interning district names as small integer ids
+typedef struct DistrictTable {
+    char (*names)[50]; // District name for each id
+    int count;         // Number of districts interned
+    int capacity;      // Room in names
+    int *index;        // Open-addressing slots holding id + 1 (0 = empty)
+    int indexCapacity; // Number of slots in index, always a power of two
+} DistrictTable;
+
+static DistrictTable districts; // Every district name seen so far, shared by all towns
+
+// Function to release the storage of a district table
+void clearDistrictTable(DistrictTable *districts) {
+    free(districts->names);
+    free(districts->index);
+    memset(districts, 0, sizeof(*districts));
+}
+
+// Function to look up the id of a district name, or -1 if it was never interned
+int findDistrict(DistrictTable *districts, const char *name) {
+    if (districts->indexCapacity == 0)
+        return -1;
+
+    unsigned int mask = districts->indexCapacity - 1;
+    unsigned int index = hash((char*)name) & mask;
+    while (districts->index[index] != 0) {
+        int id = districts->index[index] - 1;
+        if (strcmp(districts->names[id], name) == 0)
+            return id;
+        index = (index + 1) & mask;
+    }
+    return -1;
+}
+
+// Function to get the id of a district name, adding the name if it is new
+int internDistrict(DistrictTable *districts, const char *name) {
+    int id = findDistrict(districts, name);
+    if (id >= 0)
+        return id;
+
+    // Grow the name array
+    if (districts->count == districts->capacity) {
+        int capacity = districts->capacity ? districts->capacity * 2 : 16;
+        char (*names)[50] = realloc(districts->names, capacity * sizeof(*names));
+        if (names == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        districts->names = names;
+        districts->capacity = capacity;
+    }
+
+    // Keep the index at most half full, rebuilding it when it doubles
+    if (2 * (districts->count + 1) > districts->indexCapacity) {
+        int indexCapacity = districts->indexCapacity ? districts->indexCapacity * 2 : 32;
+        int *slots = (int*)calloc(indexCapacity, sizeof(int));
+        if (slots == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        for (int i = 0; i < districts->count; i++) {
+            unsigned int index = hash(districts->names[i]) & (indexCapacity - 1);
+            while (slots[index] != 0)
+                index = (index + 1) & (indexCapacity - 1);
+            slots[index] = i + 1;
+        }
+        free(districts->index);
+        districts->index = slots;
+        districts->indexCapacity = indexCapacity;
+    }
+
+    id = districts->count++;
+    strncpy(districts->names[id], name, sizeof(districts->names[id]) - 1);
+    districts->names[id][sizeof(districts->names[id]) - 1] = '\0';
+
+    unsigned int mask = districts->indexCapacity - 1;
+    unsigned int index = hash(districts->names[id]) & mask;
+    while (districts->index[index] != 0)
+        index = (index + 1) & mask;
+    districts->index[index] = id + 1;
+    return id;
+}
+
+// Function to get the name of a district id
+char* districtName(int districtId) {
+    return districts.names[districtId];
+}
+
+// Function to get the text form of a municipality flag
+const char* municipalityName(int hasMunicipality) {
+    return hasMunicipality ? "yes" : "no";
+}
+
+// Function to read a yes/no municipality answer in any case; returns 1, 0, or -1 if it is neither
+int parseMunicipality(const char *text) {
+    if (strcasecmp(text, "yes") == 0)
+        return 1;
+    if (strcasecmp(text, "no") == 0)
+        return 0;
+    return -1;
+}
+
+// Function to write everything to a file descriptor, retrying short writes
+int writeAll(int fd, const void *data, size_t size) {
+    const char *p = (const char*)data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0)
+            return 0;
+        p += written;
+        size -= written;
+    }
+    return 1;
+}
+
+// Define the output formats for listings and exports
+#define OUTPUT_TEXT 0  // "Town: ..., District: ..." as shown by the menu
+#define OUTPUT_COLON 1 // district:town:population:elevation:yes|no, the towns.txt format
+#define OUTPUT_CSV 2   // Comma separated, with a header line on exports
+#define OUTPUT_JSON 3  // One JSON object per line
+
+#define OUTPUT_BUFFER_SIZE (1 << 16) // Bytes formatted before each write
+#define OUTPUT_MAX_ROW 1024          // Room for one row with both names fully escaped
+
+// Define a buffered writer: rows are formatted by hand into one reusable
+// buffer and reach the file descriptor in large writes
+typedef struct OutputWriter {
+    int fd;       // Destination
+    int format;   // One of the OUTPUT_* formats
+    char *buffer; // Formatted bytes not written yet
+    size_t used;
+    int failed;   // Set once a write has failed
+} OutputWriter;
+
+static char standardOutputBuffer[OUTPUT_BUFFER_SIZE];
+static OutputWriter output = { STDOUT_FILENO, OUTPUT_TEXT, standardOutputBuffer, 0, 0 }; // Writer behind every listing
+
+// Function to get the format named on the command line or in the menu, or -1
+int parseOutputFormat(const char *name) {
+    if (strcasecmp(name, "text") == 0)
+        return OUTPUT_TEXT;
+    if (strcasecmp(name, "colon") == 0)
+        return OUTPUT_COLON;
+    if (strcasecmp(name, "csv") == 0)
+        return OUTPUT_CSV;
+    if (strcasecmp(name, "json") == 0)
+        return OUTPUT_JSON;
+    return -1;
+}
+
+// Function to write out whatever a writer has buffered
+int flushOutput(OutputWriter *writer) {
+    if (writer->used > 0 && !writer->failed && !writeAll(writer->fd, writer->buffer, writer->used))
+        writer->failed = 1;
+    writer->used = 0;
+    return !writer->failed;
+}
+
+// Function to make sure a row of up to OUTPUT_MAX_ROW bytes fits in the buffer
+static inline void reserveOutput(OutputWriter *writer) {
+    if (writer->used == 0 && writer->fd == STDOUT_FILENO)
+        fflush(stdout); // Keep the rows after the prompts printed through stdio
+    if (writer->used + OUTPUT_MAX_ROW > OUTPUT_BUFFER_SIZE)
+        flushOutput(writer);
+}
+
+// Function to append a string
+static inline void putString(OutputWriter *writer, const char *text) {
+    size_t length = strlen(text);
+    memcpy(writer->buffer + writer->used, text, length);
+    writer->used += length;
+}
+
+// Function to append an integer without going through printf
+static inline void putInteger(OutputWriter *writer, int value) {
+    char digits[12];
+    int n = 0;
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do {
+        digits[n++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    char *p = writer->buffer + writer->used;
+    if (value < 0)
+        *p++ = '-';
+    while (n > 0)
+        *p++ = digits[--n];
+    writer->used = p - writer->buffer;
+}
+
+// Function to append a CSV field, quoted only when it needs to be
+static inline void putCsvField(OutputWriter *writer, const char *text) {
+    if (strpbrk(text, ",\"\r\n") == NULL) {
+        putString(writer, text);
+        return;
+    }
+    char *p = writer->buffer + writer->used;
+    *p++ = '"';
+    for (; *text != '\0'; text++) {
+        if (*text == '"')
+            *p++ = '"';
+        *p++ = *text;
+    }
+    *p++ = '"';
+    writer->used = p - writer->buffer;
+}
+
+// Function to append a JSON string literal
+static inline void putJsonString(OutputWriter *writer, const char *text) {
+    static const char hexDigits[] = "0123456789abcdef";
+    char *p = writer->buffer + writer->used;
+    *p++ = '"';
+    for (; *text != '\0'; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hexDigits[c >> 4];
+            p[5] = hexDigits[c & 15];
+            p += 6;
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    *p++ = '"';
+    writer->used = p - writer->buffer;
+}
+
+// Function to write the CSV header line, other formats have none
+void writeOutputHeader(OutputWriter *writer) {
+    if (writer->format == OUTPUT_CSV) {
+        reserveOutput(writer);
+        putString(writer, "district,town,population,elevation,municipality\n");
+    }
+}
+
+// Function to append one town in the writer's format
+void writeTown(OutputWriter *writer, Town *town) {
+    reserveOutput(writer);
+    const char *district = districtName(town->districtId);
+    const char *municipality = municipalityName(town->hasMunicipality);
+
+    switch (writer->format) {
+        case OUTPUT_COLON:
+            putString(writer, district);
+            putString(writer, ":");
+            putString(writer, town->town);
+            putString(writer, ":");
+            putInteger(writer, town->population);
+            putString(writer, ":");
+            putInteger(writer, town->elevation);
+            putString(writer, ":");
+            putString(writer, municipality);
+            break;
+        case OUTPUT_CSV:
+            putCsvField(writer, district);
+            putString(writer, ",");
+            putCsvField(writer, town->town);
+            putString(writer, ",");
+            putInteger(writer, town->population);
+            putString(writer, ",");
+            putInteger(writer, town->elevation);
+            putString(writer, ",");
+            putString(writer, municipality);
+            break;
+        case OUTPUT_JSON:
+            putString(writer, "{\"district\":");
+            putJsonString(writer, district);
+            putString(writer, ",\"town\":");
+            putJsonString(writer, town->town);
+            putString(writer, ",\"population\":");
+            putInteger(writer, town->population);
+            putString(writer, ",\"elevation\":");
+            putInteger(writer, town->elevation);
+            putString(writer, ",\"municipality\":");
+            putString(writer, town->hasMunicipality ? "true" : "false");
+            putString(writer, "}");
+            break;
+        default:
+            putString(writer, "Town: ");
+            putString(writer, town->town);
+            putString(writer, ", District: ");
+            putString(writer, district);
+            putString(writer, ", Population: ");
+            putInteger(writer, town->population);
+            putString(writer, ", Elevation: ");
+            putInteger(writer, town->elevation);
+            putString(writer, ", Municipality: ");
+            putString(writer, municipality);
+            break;
+    }
+    writer->buffer[writer->used++] = '\n';
+}
+
+// Function to print a town found through an index
+void printTown(Town *town) {
+    writeTown(&output, town);
+}
+
+// Function to list the towns whose population lies in [min, max], smallest first
+void listTownsInPopulationRange(Town *populationRoot, int min, int max) {
+    TownCursor cursor;
+    cursorInit(&cursor, populationRoot, ORDER_BY_POPULATION);
+    for (Town *node = cursorSeekPopulation(&cursor, min); node != NULL && node->population <= max; node = cursorNext(&cursor))
+        printTown(node);
+    flushOutput(&output);
+}
+
+// Function to list the largest towns, largest first
+void listLargestTowns(Town *populationRoot, int count) {
+    TownCursor cursor;
+    cursorInit(&cursor, populationRoot, ORDER_BY_POPULATION);
+    for (Town *node = cursorLast(&cursor); node != NULL && count > 0; node = cursorPrev(&cursor), count--)
+        printTown(node);
+    flushOutput(&output);
+}
+
+// Function to list up to `count` towns in alphabetical order starting at the first
+// name at or after `town`, or the `count` towns before it when `backwards` is set
+void listTownsFrom(Town *root, char town[], int count, int backwards) {
+    TownCursor cursor;
+    cursorInit(&cursor, root, ORDER_BY_NAME);
+    Town *node = cursorSeek(&cursor, town);
+    if (backwards)
+        node = node != NULL ? cursorPrev(&cursor) : cursorLast(&cursor);
+
+    for (; node != NULL && count > 0; count--) {
+        printTown(node);
+        node = backwards ? cursorPrev(&cursor) : cursorNext(&cursor);
+    }
+    flushOutput(&output);
+}
+
+// Function to list towns like listTownsFrom, walking the leaves of the B+-tree;
+// a NULL `town` starts from the first town
+void btreeListTownsFrom(BTree *tree, char town[], int count, int backwards) {
+    BTreeCursor cursor;
+    Town *node = btreeSeek(tree, &cursor, town);
+    if (backwards)
+        node = node != NULL ? btreePrev(&cursor) : btreeLast(tree, &cursor);
+
+    for (; node != NULL && count > 0; count--) {
+        printTown(node);
+        node = backwards ? btreePrev(&cursor) : btreeNext(&cursor);
+    }
+    flushOutput(&output);
+}
+
+// Define the bitmap indexes: every town owns a row number, and each bitmap
+// holds one bit per row, so filters combine with word-wide AND operations
+typedef struct BitmapIndex {
+    Town **rows;            // Town stored in each row (NULL for free rows)
+    int rowCount;           // Rows handed out so far
+    int capacity;           // Rows with room in every bitmap, a multiple of 64
+    int *freeRows;          // Rows released by deletes, reused first
+    int freeCount;          // Number of entries in freeRows
+    int liveCount;          // Rows that hold a town
+    uint64_t *live;         // Rows that hold a town
+    uint64_t *municipality; // Rows whose town has a municipality
+    uint64_t **districts;   // One bitmap per district id (NULL until the district is used)
+    int districtCount;      // Number of entries in districts
+} BitmapIndex;
+
+// Function to resize one bitmap, clearing the new words
+uint64_t* growBitmap(uint64_t *bits, int oldWords, int newWords) {
+    bits = (uint64_t*)realloc(bits, newWords * sizeof(uint64_t));
+    if (bits == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    memset(bits + oldWords, 0, (newWords - oldWords) * sizeof(uint64_t));
+    return bits;
+}
+
+// Function to make room for at least `rows` rows in every bitmap
+void reserveRows(BitmapIndex *index, int rows) {
+    if (rows <= index->capacity)
+        return;
+
+    int capacity = index->capacity ? index->capacity : 1024;
+    while (capacity < rows)
+        capacity *= 2;
+    int oldWords = index->capacity / 64, newWords = capacity / 64;
+
+    index->rows = (Town**)realloc(index->rows, capacity * sizeof(Town*));
+    index->freeRows = (int*)realloc(index->freeRows, capacity * sizeof(int));
+    if (index->rows == NULL || index->freeRows == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    index->live = growBitmap(index->live, oldWords, newWords);
+    index->municipality = growBitmap(index->municipality, oldWords, newWords);
+    for (int i = 0; i < index->districtCount; i++) {
+        if (index->districts[i] != NULL)
+            index->districts[i] = growBitmap(index->districts[i], oldWords, newWords);
+    }
+    index->capacity = capacity;
+}
+
+// Function to get the bitmap of a district, creating it on first use
+uint64_t* districtBitmap(BitmapIndex *index, int districtId) {
+    if (districtId >= index->districtCount) {
+        int count = districtId + 1;
+        index->districts = (uint64_t**)realloc(index->districts, count * sizeof(uint64_t*));
+        if (index->districts == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        for (int i = index->districtCount; i < count; i++)
+            index->districts[i] = NULL;
+        index->districtCount = count;
+    }
+    if (index->districts[districtId] == NULL)
+        index->districts[districtId] = growBitmap(NULL, 0, index->capacity / 64);
+    return index->districts[districtId];
+}
+
+// Function to give a town a row and set its bits
+void bitmapAddTown(BitmapIndex *index, Town *town) {
+    int row;
+    if (index->freeCount > 0) {
+        row = index->freeRows[--index->freeCount];
+    } else {
+        reserveRows(index, index->rowCount + 1);
+        row = index->rowCount++;
+    }
+
+    uint64_t bit = 1ULL << (row % 64);
+    index->rows[row] = town;
+    index->live[row / 64] |= bit;
+    if (town->hasMunicipality)
+        index->municipality[row / 64] |= bit;
+    districtBitmap(index, town->districtId)[row / 64] |= bit;
+    index->liveCount++;
+    town->row = row;
+}
+
+// Function to clear a town's bits and release its row
+void bitmapRemoveTown(BitmapIndex *index, Town *town) {
+    int row = town->row;
+    uint64_t bit = 1ULL << (row % 64);
+    index->rows[row] = NULL;
+    index->live[row / 64] &= ~bit;
+    index->municipality[row / 64] &= ~bit;
+    index->districts[town->districtId][row / 64] &= ~bit;
+    index->freeRows[index->freeCount++] = row;
+    index->liveCount--;
+}
+
+// Function to refresh a town's municipality bit after the flag changed
+void bitmapSetMunicipality(BitmapIndex *index, Town *town) {
+    uint64_t bit = 1ULL << (town->row % 64);
+    if (town->hasMunicipality)
+        index->municipality[town->row / 64] |= bit;
+    else
+        index->municipality[town->row / 64] &= ~bit;
+}
+
+// Function to find the towns in a district (or any district when districtId
+// is -1) with the given municipality flag (or either when it is -1).
+// Returns the number of towns stored in `results`, which needs room for every town.
+int queryBitmaps(BitmapIndex *index, int districtId, int hasMunicipality, Town **results) {
+    uint64_t *district = NULL;
+    if (districtId >= 0) {
+        if (districtId >= index->districtCount || index->districts[districtId] == NULL)
+            return 0; // No town was ever stored in this district
+        district = index->districts[districtId];
+    }
+
+    int count = 0, words = (index->rowCount + 63) / 64;
+    for (int i = 0; i < words; i++) {
+        uint64_t word = index->live[i];
+        if (district != NULL)
+            word &= district[i];
+        if (hasMunicipality == 1)
+            word &= index->municipality[i];
+        else if (hasMunicipality == 0)
+            word &= ~index->municipality[i];
+
+        // Visit each set bit
+        while (word != 0) {
+            results[count++] = index->rows[i * 64 + __builtin_ctzll(word)];
+            word &= word - 1;
+        }
+    }
+    return count;
+}
+
+// Function to release the storage of the bitmap indexes
+void freeBitmapIndex(BitmapIndex *index) {
+    for (int i = 0; i < index->districtCount; i++)
+        free(index->districts[i]);
+    free(index->districts);
+    free(index->rows);
+    free(index->freeRows);
+    free(index->live);
+    free(index->municipality);
+    memset(index, 0, sizeof(*index));
+}
+
+// Function to order town pointers by name
+int compareTownNames(const void *a, const void *b) {
+    return strcmp((*(Town* const*)a)->town, (*(Town* const*)b)->town);
+}
+
+// Function to list the towns matching a bitmap query in alphabetical order
+void listTownsByBitmap(BitmapIndex *index, int districtId, int hasMunicipality) {
+    Town **results = (Town**)malloc((index->liveCount + 1) * sizeof(Town*));
+    if (results == NULL) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
+    int count = queryBitmaps(index, districtId, hasMunicipality, results);
+    qsort(results, count, sizeof(Town*), compareTownNames);
+    for (int i = 0; i < count; i++)
+        printTown(results[i]);
+    flushOutput(&output);
+    printf("%d towns found.\n", count);
+    free(results);
+}
+
+
+// Define the columnar mirror of the towns: one contiguous array per field,
+// indexed by the same rows as the bitmap indexes, so analytical scans read
+// only the columns they need instead of whole Town nodes
+typedef struct ColumnStore {
+    int *population;            // Population of the town in each row
+    int *elevation;             // Elevation of the town in each row
+    int *districtId;            // District id of the town in each row
+    unsigned char *municipality; // Municipality flag of the town in each row
+    int capacity;               // Rows with room in every column
+} ColumnStore;
+
+// Define the aggregates computed by the column kernels
+typedef struct ColumnStats {
+    int count;                // Number of towns aggregated
+    long long populationSum;  // Total population
+    int minPopulation;        // Smallest population
+    int maxPopulation;        // Largest population
+    long long elevationSum;   // Total elevation
+    int minElevation;         // Lowest elevation
+    int maxElevation;         // Highest elevation
+} ColumnStats;
+
+// Function to resize one column, clearing the new rows
+void* growColumn(void *column, size_t width, int oldRows, int newRows) {
+    column = realloc(column, newRows * width);
+    if (column == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    memset((char*)column + oldRows * width, 0, (newRows - oldRows) * width);
+    return column;
+}
+
+// Function to copy a town's fields into its row of every column
+void columnsStoreTown(ColumnStore *columns, BitmapIndex *index, Town *town) {
+    // Columns follow the row capacity of the bitmap indexes
+    if (columns->capacity < index->capacity) {
+        columns->population = growColumn(columns->population, sizeof(int), columns->capacity, index->capacity);
+        columns->elevation = growColumn(columns->elevation, sizeof(int), columns->capacity, index->capacity);
+        columns->districtId = growColumn(columns->districtId, sizeof(int), columns->capacity, index->capacity);
+        columns->municipality = growColumn(columns->municipality, 1, columns->capacity, index->capacity);
+        columns->capacity = index->capacity;
+    }
+
+    columns->population[town->row] = town->population;
+    columns->elevation[town->row] = town->elevation;
+    columns->districtId[town->row] = town->districtId;
+    columns->municipality[town->row] = town->hasMunicipality;
+}
+
+// Function to release the storage of the column store
+void freeColumnStore(ColumnStore *columns) {
+    free(columns->population);
+    free(columns->elevation);
+    free(columns->districtId);
+    free(columns->municipality);
+    memset(columns, 0, sizeof(*columns));
+}
+
+// Function to clear the selection bits of rows whose value lies outside [min, max].
+// The comparisons are branch free so the compiler can vectorize them.
+void filterColumnRange(const int *values, int words, int min, int max, uint64_t *selection) {
+    unsigned int span = (unsigned int)max - (unsigned int)min;
+    for (int w = 0; w < words; w++) {
+        if (selection[w] == 0)
+            continue; // Nothing left to filter in these 64 rows
+        const int *block = values + w * 64;
+        unsigned char match[64];
+        for (int j = 0; j < 64; j++)
+            match[j] = (unsigned int)block[j] - (unsigned int)min <= span;
+
+        // Pack eight 0/1 bytes into eight bits with one multiply (little-endian byte order)
+        uint64_t word = 0;
+        for (int k = 0; k < 8; k++) {
+            uint64_t bytes;
+            memcpy(&bytes, match + k * 8, 8);
+            word |= ((bytes * 0x0102040810204080ULL) >> 56) << (k * 8);
+        }
+        selection[w] &= word;
+    }
+}
+
+// Function to reset aggregates before a scan
+void initColumnStats(ColumnStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->minPopulation = INT_MAX;
+    stats->maxPopulation = INT_MIN;
+    stats->minElevation = INT_MAX;
+    stats->maxElevation = INT_MIN;
+}
+
+// Function to aggregate the population and elevation of the selected rows
+void aggregateColumns(ColumnStore *columns, const uint64_t *selection, int words, ColumnStats *stats) {
+    for (int w = 0; w < words; w++) {
+        uint64_t word = selection[w];
+        if (word == 0)
+            continue;
+
+        const int *population = columns->population + w * 64;
+        const int *elevation = columns->elevation + w * 64;
+        if (word == ~0ULL) {
+            // A full block: plain loops over contiguous values vectorize well
+            long long populationSum = 0, elevationSum = 0;
+            int minPopulation = stats->minPopulation, maxPopulation = stats->maxPopulation;
+            int minElevation = stats->minElevation, maxElevation = stats->maxElevation;
+            for (int j = 0; j < 64; j++) {
+                populationSum += population[j];
+                elevationSum += elevation[j];
+                minPopulation = population[j] < minPopulation ? population[j] : minPopulation;
+                maxPopulation = population[j] > maxPopulation ? population[j] : maxPopulation;
+                minElevation = elevation[j] < minElevation ? elevation[j] : minElevation;
+                maxElevation = elevation[j] > maxElevation ? elevation[j] : maxElevation;
+            }
+            stats->count += 64;
+            stats->populationSum += populationSum;
+            stats->elevationSum += elevationSum;
+            stats->minPopulation = minPopulation;
+            stats->maxPopulation = maxPopulation;
+            stats->minElevation = minElevation;
+            stats->maxElevation = maxElevation;
+            continue;
+        }
+
+        // A sparse block: visit each set bit
+        while (word != 0) {
+            int j = __builtin_ctzll(word);
+            word &= word - 1;
+            stats->count++;
+            stats->populationSum += population[j];
+            stats->elevationSum += elevation[j];
+            if (population[j] < stats->minPopulation)
+                stats->minPopulation = population[j];
+            if (population[j] > stats->maxPopulation)
+                stats->maxPopulation = population[j];
+            if (elevation[j] < stats->minElevation)
+                stats->minElevation = elevation[j];
+            if (elevation[j] > stats->maxElevation)
+                stats->maxElevation = elevation[j];
+        }
+    }
+}
+
+// Function to print one line of the district report
+void printColumnStats(const char *label, ColumnStats *stats) {
+    if (stats->count == 0)
+        return;
+    printf("%-20s %8d %14lld %12.1f %10d %10d %10.1f\n", label, stats->count, stats->populationSum,
+           (double)stats->populationSum / stats->count, stats->minElevation, stats->maxElevation,
+           (double)stats->elevationSum / stats->count);
+}
+
+// Function to report population and elevation aggregates per district for the
+// towns whose population and elevation lie in the given ranges
+void printDistrictReport(ColumnStore *columns, BitmapIndex *index, int minPopulation, int maxPopulation,
+                         int minElevation, int maxElevation) {
+    int words = (index->rowCount + 63) / 64;
+    uint64_t *selection = (uint64_t*)malloc((words + 1) * sizeof(uint64_t));
+    uint64_t *districtSelection = (uint64_t*)malloc((words + 1) * sizeof(uint64_t));
+    if (selection == NULL || districtSelection == NULL) {
+        printf("Memory allocation failed!\n");
+        free(selection);
+        free(districtSelection);
+        return;
+    }
+
+    // Filter once over the whole registry
+    memcpy(selection, index->live, words * sizeof(uint64_t));
+    filterColumnRange(columns->population, words, minPopulation, maxPopulation, selection);
+    filterColumnRange(columns->elevation, words, minElevation, maxElevation, selection);
+
+    printf("%-20s %8s %14s %12s %10s %10s %10s\n", "District", "Towns", "Population", "Average",
+           "Min elev.", "Max elev.", "Avg elev.");
+
+    // Then aggregate each district's share of the selection
+    for (int d = 0; d < index->districtCount; d++) {
+        if (index->districts[d] == NULL)
+            continue;
+        for (int w = 0; w < words; w++)
+            districtSelection[w] = selection[w] & index->districts[d][w];
+
+        ColumnStats stats;
+        initColumnStats(&stats);
+        aggregateColumns(columns, districtSelection, words, &stats);
+        printColumnStats(districtName(d), &stats);
+    }
+
+    ColumnStats total;
+    initColumnStats(&total);
+    aggregateColumns(columns, selection, words, &total);
+    if (total.count == 0)
+        printf("No towns match.\n");
+    else
+        printColumnStats("All districts", &total);
+
+    free(selection);
+    free(districtSelection);
+}
+
+// Define the n-gram index behind the fuzzy name search. Every name is folded
+// to lower case, padded with two markers at each end, and cut into
+// overlapping 3-byte grams; each gram's bucket lists the towns containing it,
+// as postings that pack the town's row with its name length. One edit
+// destroys at most 3 grams, so a name within k edits of the query still
+// contains at least T = (grams of the query) - 3k of the query's grams, and
+// therefore appears in at least one of any (grams - T + 1) of their lists.
+// A search takes its candidates from that many of the shortest lists, counts
+// how many of the other lists each candidate appears in, and compares only
+// the candidates that reach T character by character. Grams that share a
+// bucket only raise the counts, so they never lose a match.
+#define NGRAM_SIZE 3
+#define NGRAM_BUCKETS (1 << 16) // A power of two
+#define NGRAM_PAD 1             // Byte that pads names, not found in any name
+#define POSTING_LENGTH_BITS 6   // Low bits of a posting hold the name length (names are under 64 bytes)
+#define FUZZY_MAX_EDITS 3       // Largest edit distance a search accepts
+#define NGRAM_MAX_GRAMS (50 + NGRAM_SIZE - 1) // Grams of the longest name
+
+typedef struct PostingList {
+    int *postings; // (row << POSTING_LENGTH_BITS) | name length, once per gram occurrence
+    int count;
+    int capacity;
+} PostingList;
+
+typedef struct NgramIndex {
+    PostingList *buckets; // NGRAM_BUCKETS lists (NULL until the first town is added)
+    long postings;        // Postings of the towns in the index
+    long stale;           // Postings of removed towns still in the lists
+    unsigned short *counts; // Scratch: lists each candidate row of the current search appears in
+    int *touched;           // Scratch: rows whose count is not zero
+    int scratchRows;        // Rows with room in counts and touched
+} NgramIndex;
+
+// Define one result of a fuzzy search
+typedef struct FuzzyMatch {
+    Town *town;
+    int distance; // Edits between the query and the name, ignoring case
+} FuzzyMatch;
+
+// Function to fold a name to lower case between the padding markers; returns its number of grams
+int padName(const char *name, unsigned char *padded) {
+    int length = 0;
+    padded[0] = padded[1] = NGRAM_PAD;
+    for (; name[length] != '\0'; length++)
+        padded[length + 2] = (unsigned char)tolower((unsigned char)name[length]);
+    padded[length + 2] = padded[length + 3] = NGRAM_PAD;
+    return length + NGRAM_SIZE - 1;
+}
+
+// Function to get the bucket of the gram starting at p
+static inline unsigned int ngramBucket(const unsigned char *p) {
+    uint32_t gram = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (gram * 2654435761u) >> (32 - 16); // Multiplicative hashing keeps the top 16 bits
+}
+
+// Function to add a town's grams to the index
+void ngramAddTown(NgramIndex *index, Town *town) {
+    if (index->buckets == NULL) {
+        index->buckets = (PostingList*)calloc(NGRAM_BUCKETS, sizeof(PostingList));
+        if (index->buckets == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+    unsigned char padded[sizeof(town->town) + 4];
+    int grams = padName(town->town, padded);
+    int posting = town->row << POSTING_LENGTH_BITS | (grams - (NGRAM_SIZE - 1));
+    for (int i = 0; i < grams; i++) {
+        PostingList *list = &index->buckets[ngramBucket(padded + i)];
+        if (list->count == list->capacity) {
+            int newCapacity = list->capacity > 0 ? 2 * list->capacity : 4;
+            int *grown = (int*)realloc(list->postings, newCapacity * sizeof(int));
+            if (grown == NULL) {
+                printf("Memory allocation failed!\n");
+                exit(1);
+            }
+            list->postings = grown;
+            list->capacity = newCapacity;
+        }
+        list->postings[list->count++] = posting;
+    }
+    index->postings += grams;
+}
+
+// Function to note that a town left the index. Its postings stay in the lists
+// until a compaction, since finding them means scanning lists that can hold
+// thousands of towns; meanwhile they can only add candidates to a search.
+void ngramRemoveTown(NgramIndex *index, Town *town) {
+    int grams = strlen(town->town) + NGRAM_SIZE - 1;
+    index->postings -= grams;
+    index->stale += grams;
+}
+
+// Function to rebuild the lists from the towns in the bitmap rows once removed
+// towns account for more postings than the towns still there
+void ngramCompact(NgramIndex *index, BitmapIndex *bitmaps) {
+    if (index->stale <= index->postings || index->buckets == NULL)
+        return;
+    for (int i = 0; i < NGRAM_BUCKETS; i++)
+        index->buckets[i].count = 0;
+    index->postings = index->stale = 0;
+    for (int row = 0; row < bitmaps->rowCount; row++)
+        if (bitmaps->rows[row] != NULL)
+            ngramAddTown(index, bitmaps->rows[row]);
+}
+
+// Function to release the index
+void freeNgramIndex(NgramIndex *index) {
+    if (index->buckets != NULL)
+        for (int i = 0; i < NGRAM_BUCKETS; i++)
+            free(index->buckets[i].postings);
+    free(index->buckets);
+    free(index->counts);
+    free(index->touched);
+    memset(index, 0, sizeof(*index));
+}
+
+// Function to get the most edits a fuzzy search allows for a query of a given
+// length. Short queries get fewer, so every query keeps at least two grams
+// that a match must share and can be answered from the index.
+int fuzzyEditLimit(int length) {
+    if (length <= 2)
+        return 0;
+    if (length <= 5)
+        return 1;
+    if (length <= 9)
+        return 2;
+    return FUZZY_MAX_EDITS;
+}
+
+// Function to compute the edit distance between two strings, giving up with
+// maxEdits + 1 as soon as it must exceed maxEdits. Only the cells within
+// maxEdits of the diagonal can stay under the bound, so only those are filled.
+int boundedEditDistance(const unsigned char *a, int aLength, const unsigned char *b, int bLength, int maxEdits) {
+    if (abs(aLength - bLength) > maxEdits)
+        return maxEdits + 1;
+    int previous[64], current[64]; // Names are shorter than 50 bytes
+    for (int j = 0; j <= bLength; j++)
+        previous[j] = j <= maxEdits ? j : maxEdits + 1;
+    memcpy(current, previous, (bLength + 1) * sizeof(int));
+
+    for (int i = 1; i <= aLength; i++) {
+        int from = i - maxEdits > 1 ? i - maxEdits : 1;
+        int to = i + maxEdits < bLength ? i + maxEdits : bLength;
+        int best = maxEdits + 1;
+        current[0] = i <= maxEdits ? i : maxEdits + 1;
+        if (from > 1)
+            current[from - 1] = maxEdits + 1; // Left edge of the band
+        for (int j = from; j <= to; j++) {
+            int cost = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            if (previous[j] + 1 < cost)
+                cost = previous[j] + 1;
+            if (current[j - 1] + 1 < cost)
+                cost = current[j - 1] + 1;
+            current[j] = cost < maxEdits + 1 ? cost : maxEdits + 1;
+            if (current[j] < best)
+                best = current[j];
+        }
+        if (to < bLength)
+            current[to + 1] = maxEdits + 1; // Right edge of the band
+        if (best > maxEdits && current[0] > maxEdits)
+            return maxEdits + 1;
+        memcpy(previous, current, (bLength + 1) * sizeof(int));
+    }
+    return previous[bLength];
+}
+
+// Function to order fuzzy matches: fewest edits first, then by name
+int compareFuzzyMatches(const void *a, const void *b) {
+    const FuzzyMatch *x = (const FuzzyMatch*)a, *y = (const FuzzyMatch*)b;
+    if (x->distance != y->distance)
+        return x->distance < y->distance ? -1 : 1;
+    return strcmp(x->town->town, y->town->town);
+}
+
+// Function to order gram buckets by the length of their lists, shortest first
+static PostingList *sortedBuckets; // Lists of the index being searched, for compareBucketLengths
+int compareBucketLengths(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    if (sortedBuckets[x].count != sortedBuckets[y].count)
+        return sortedBuckets[x].count < sortedBuckets[y].count ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// Function to find every town within maxEdits edits of a name, ignoring case;
+// maxEdits is lowered to fuzzyEditLimit for short names. *matches is set to a
+// malloc'ed array, closest first. Returns the number of matches.
+int fuzzySearch(NgramIndex *index, BitmapIndex *bitmaps, const char *name, int maxEdits, FuzzyMatch **matches) {
+    unsigned char query[sizeof(((Town*)0)->town) + 4];
+    char bounded[sizeof(((Town*)0)->town)];
+    snprintf(bounded, sizeof(bounded), "%s", name);
+    int grams = padName(bounded, query);
+    int queryLength = grams - (NGRAM_SIZE - 1);
+    if (maxEdits > fuzzyEditLimit(queryLength))
+        maxEdits = fuzzyEditLimit(queryLength);
+    int count = 0, capacity = 0, touched = 0;
+    *matches = NULL;
+    if (index->buckets == NULL)
+        return 0;
+
+    if (index->scratchRows < bitmaps->rowCount) {
+        free(index->counts);
+        free(index->touched);
+        index->scratchRows = bitmaps->capacity;
+        index->counts = (unsigned short*)calloc(index->scratchRows, sizeof(unsigned short));
+        index->touched = (int*)malloc(index->scratchRows * sizeof(int));
+        if (index->counts == NULL || index->touched == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+
+    // Take candidates from the shortest lists that every match must appear in
+    // at least once, then count the other lists for those candidates only
+    int buckets[NGRAM_MAX_GRAMS];
+    for (int i = 0; i < grams; i++)
+        buckets[i] = ngramBucket(query + i);
+    sortedBuckets = index->buckets;
+    qsort(buckets, grams, sizeof(int), compareBucketLengths);
+    int needed = grams - NGRAM_SIZE * maxEdits; // T
+    for (int i = 0; i < grams; i++) {
+        PostingList *list = &index->buckets[buckets[i]];
+        int nominate = i <= grams - needed;
+        for (int j = 0; j < list->count; j++) {
+            int posting = list->postings[j];
+            int row = posting >> POSTING_LENGTH_BITS;
+            if (index->counts[row] > 0) {
+                index->counts[row]++;
+            } else if (nominate && abs((posting & ((1 << POSTING_LENGTH_BITS) - 1)) - queryLength) <= maxEdits) {
+                index->counts[row] = 1; // Every edit changes the length by at most one
+                index->touched[touched++] = row;
+            }
+        }
+    }
+
+    // Compare the candidates found in enough lists with the query
+    for (int i = 0; i < touched; i++) {
+        int row = index->touched[i];
+        int shared = index->counts[row];
+        index->counts[row] = 0;
+        Town *town = bitmaps->rows[row];
+        if (shared < needed || town == NULL)
+            continue; // Too few grams in common, or a removed town's posting
+        unsigned char padded[sizeof(town->town) + 4];
+        int length = padName(town->town, padded) - (NGRAM_SIZE - 1);
+        int distance = boundedEditDistance(padded + 2, length, query + 2, queryLength, maxEdits);
+        if (distance > maxEdits)
+            continue;
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            FuzzyMatch *grown = (FuzzyMatch*)realloc(*matches, capacity * sizeof(FuzzyMatch));
+            if (grown == NULL) {
+                printf("Memory allocation failed!\n");
+                exit(1);
+            }
+            *matches = grown;
+        }
+        (*matches)[count].town = town;
+        (*matches)[count++].distance = distance;
+    }
+
+    if (count > 1)
+        qsort(*matches, count, sizeof(FuzzyMatch), compareFuzzyMatches);
+    return count;
+}
+
+// Function to print towns in alphabetical order (in-order traversal of AVL tree)
+void inOrder(Town* root) {
+    TownCursor cursor;
+    cursorInit(&cursor, root, ORDER_BY_NAME);
+    for (Town *node = cursorFirst(&cursor); node != NULL; node = cursorNext(&cursor))
+        printTown(node);
+    flushOutput(&output);
+}
+
+// Function to list towns with a population greater than a given number, using the population index
+void listTownsByPopulation(Town* populationRoot, int population) {
+    if (population < INT_MAX)
+        listTownsInPopulationRange(populationRoot, population + 1, INT_MAX);
+}
+
+// Function to list towns based on municipality status, using the bitmap index
+void listTownsByMunicipality(BitmapIndex *index, int hasMunicipality) {
+    listTownsByBitmap(index, -1, hasMunicipality);
+}
+
+// Function to save the AVL tree data to a file in one of the output formats
+int saveToFile(Town* root, const char *path, int format) {
+    uint64_t started = monotonicNanoseconds();
+    char *buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(buffer);
+        return 0;
+    }
+
+    OutputWriter writer = { fd, format, buffer, 0, 0 };
+    writeOutputHeader(&writer);
+    TownCursor cursor;
+    cursorInit(&cursor, root, ORDER_BY_NAME);
+    for (Town *node = cursorFirst(&cursor); node != NULL; node = cursorNext(&cursor))
+        writeTown(&writer, node); // Write data to file
+
+    int ok = flushOutput(&writer);
+    if (close(fd) != 0)
+        ok = 0;
+    free(buffer);
+    recordOperation(TIMER_SAVE, started);
+    return ok;
+}
+
+// Define the segmented save behind menus 7 and 14. The saved towns live in
+// SEGMENT_DIR as segment files, each holding a run of towns in alphabetical
+// order in the colon format, plus a manifest that lists the segments in
+// order; concatenating them gives the whole list. Segment k holds every name
+// from its first name up to the first name of segment k + 1 (segment 0
+// starts at the beginning). The registry marks the segment of each town it
+// changes, and a save writes only those segments, into new files, then swaps
+// the manifest in with one rename. A crash leaves either the old or the new
+// set of segments, never a mix.
+#define SEGMENT_DIR "towns.txt.d"
+#define SEGMENT_MANIFEST SEGMENT_DIR "/manifest"
+#define SEGMENT_TOWNS 1024                    // Towns per segment when a range is cut into new segments
+#define SEGMENT_MAX_TOWNS (2 * SEGMENT_TOWNS) // Segments that grow past this are cut again
+
+typedef struct Segment {
+    int id;        // The file is SEGMENT_DIR/segment-<id>.txt
+    int count;     // Towns in its range, kept up to date between saves
+    int dirty;     // 1 when a town in its range changed since it was written
+    char first[50]; // Name of its first town when it was written
+} Segment;
+
+typedef struct SegmentTable {
+    Segment *segments; // In name order
+    int count;
+    int capacity;
+    int nextId;         // Id of the next segment file
+    int loaded;         // 0 until a save of this session wrote every segment
+    long changes;       // Town changes marked since the last save
+    int lastWritten;    // Segments written by the last save
+    long lastTowns;     // Towns written by the last save
+} SegmentTable;
+
+// Function to get the path of a segment file
+void segmentPath(char *path, size_t size, int id) {
+    snprintf(path, size, "%s/segment-%06d.txt", SEGMENT_DIR, id);
+}
+
+// Function to find the segment whose range holds a name
+int findSegment(SegmentTable *table, const char *town) {
+    int low = 1, high = table->count - 1, found = 0;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (strcmp(table->segments[middle].first, town) <= 0) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+// Function to note that a town was inserted (delta 1), updated (0) or deleted (-1),
+// so the next save rewrites its segment
+void markSegmentDirty(SegmentTable *table, const char *town, int delta) {
+    if (!table->loaded)
+        return; // The next save writes everything anyway
+    if (table->count == 0) {
+        table->loaded = 0; // No segment to grow: start over
+        return;
+    }
+    Segment *segment = &table->segments[findSegment(table, town)];
+    segment->dirty = 1;
+    segment->count += delta;
+    table->changes++;
+}
+
+// Function to append a segment to a growing array
+Segment* addSegment(Segment **segments, int *count, int *capacity) {
+    if (*count == *capacity) {
+        int newCapacity = *capacity > 0 ? 2 * *capacity : 16;
+        Segment *grown = (Segment*)realloc(*segments, newCapacity * sizeof(Segment));
+        if (grown == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        *segments = grown;
+        *capacity = newCapacity;
+    }
+    return &(*segments)[(*count)++];
+}
+
+// Function to find the highest segment file id in SEGMENT_DIR, removing every
+// segment file with an id below `removeBelow` on the way (-1 removes none)
+int scanSegmentFiles(int removeBelow) {
+    int highest = -1;
+    DIR *directory = opendir(SEGMENT_DIR);
+    if (directory == NULL)
+        return highest;
+    for (struct dirent *entry = readdir(directory); entry != NULL; entry = readdir(directory)) {
+        int id;
+        if (sscanf(entry->d_name, "segment-%d.txt", &id) != 1)
+            continue;
+        if (id < removeBelow) {
+            char path[300];
+            snprintf(path, sizeof(path), "%s/%s", SEGMENT_DIR, entry->d_name);
+            unlink(path);
+        } else if (id > highest) {
+            highest = id;
+        }
+    }
+    closedir(directory);
+    return highest;
+}
+
+// Function to write the towns from *node on into a new segment file, stopping
+// after `limit` towns or before the name `end` (NULL for no bound). *node is
+// left at the first town not written. Returns 0 if the file could not be written.
+int writeSegment(Segment *segment, int id, TownCursor *cursor, Town **node, const char *end, int limit, char *buffer) {
+    char path[300];
+    segmentPath(path, sizeof(path), id);
+    segment->id = id;
+    segment->count = 0;
+    segment->dirty = 0;
+    strcpy(segment->first, (*node)->town);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    OutputWriter writer = { fd, OUTPUT_COLON, buffer, 0, 0 };
+    for (; *node != NULL && segment->count < limit && (end == NULL || strcmp((*node)->town, end) < 0);
+         *node = cursorNext(cursor)) {
+        writeTown(&writer, *node);
+        segment->count++;
+    }
+    int ok = flushOutput(&writer) && fsync(fd) == 0;
+    if (close(fd) != 0)
+        ok = 0;
+    return ok;
+}
+
+// Function to write a manifest to a temporary file and rename it over the old one
+int writeManifest(Segment *segments, int count) {
+    const char *tempPath = SEGMENT_MANIFEST ".tmp";
+    FILE *file = fopen(tempPath, "w");
+    if (file == NULL)
+        return 0;
+    for (int i = 0; i < count; i++)
+        fprintf(file, "segment-%06d.txt %d %s\n", segments[i].id, segments[i].count, segments[i].first);
+    int ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0)
+        ok = 0;
+    if (ok && rename(tempPath, SEGMENT_MANIFEST) != 0)
+        ok = 0;
+    if (!ok)
+        unlink(tempPath);
+    return ok;
+}
+
+// Function to save the towns to SEGMENT_DIR. The first save of a session cuts
+// every town into new segments; later saves rewrite only the dirty segments,
+// cutting a segment again once it grows past SEGMENT_MAX_TOWNS and dropping
+// it once it is empty. Returns 0 if the save failed, leaving the old files.
+int saveSegments(SegmentTable *table, Town *root) {
+    uint64_t started = monotonicNanoseconds();
+    if (mkdir(SEGMENT_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating " SEGMENT_DIR);
+        return 0;
+    }
+    char *buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+
+    // Files left by an earlier session, or by a save that failed, are never reused
+    int full = !table->loaded;
+    if (full)
+        table->nextId = scanSegmentFiles(-1) + 1;
+    int firstNewId = table->nextId, oldCount = full ? 0 : table->count;
+    Segment *segments = NULL;
+    int count = 0, capacity = 0, ok = 1;
+    long towns = 0;
+
+    TownCursor cursor;
+    cursorInit(&cursor, root, ORDER_BY_NAME);
+    if (full) {
+        Town *node = cursorFirst(&cursor);
+        while (ok && node != NULL)
+            ok = writeSegment(addSegment(&segments, &count, &capacity), table->nextId++, &cursor, &node, NULL,
+                              SEGMENT_TOWNS, buffer);
+    }
+    for (int i = 0; ok && i < oldCount; i++) {
+        Segment *old = &table->segments[i];
+        if (!old->dirty) {
+            *addSegment(&segments, &count, &capacity) = *old;
+            continue;
+        }
+        const char *end = i + 1 < oldCount ? table->segments[i + 1].first : NULL;
+        Town *node = i == 0 ? cursorFirst(&cursor) : cursorSeek(&cursor, old->first);
+        int limit = old->count > SEGMENT_MAX_TOWNS ? SEGMENT_TOWNS : INT_MAX;
+        while (ok && node != NULL && (end == NULL || strcmp(node->town, end) < 0))
+            ok = writeSegment(addSegment(&segments, &count, &capacity), table->nextId++, &cursor, &node, end,
+                              limit, buffer);
+    }
+    for (int i = 0; i < count; i++)
+        towns += segments[i].id >= firstNewId ? segments[i].count : 0;
+
+    if (ok)
+        ok = writeManifest(segments, count);
+    if (!ok) {
+        perror("Error writing " SEGMENT_DIR);
+        for (int i = 0; i < count; i++) {
+            if (segments[i].id >= firstNewId) {
+                char path[300];
+                segmentPath(path, sizeof(path), segments[i].id);
+                unlink(path);
+            }
+        }
+        free(segments);
+        free(buffer);
+        return 0;
+    }
+
+    // The new manifest is in place, so the files it replaced can go
+    if (full) {
+        scanSegmentFiles(firstNewId);
+    } else {
+        for (int i = 0; i < oldCount; i++) {
+            if (table->segments[i].dirty) {
+                char path[300];
+                segmentPath(path, sizeof(path), table->segments[i].id);
+                unlink(path);
+            }
+        }
+    }
+
+    free(table->segments);
+    table->segments = segments;
+    table->count = count;
+    table->capacity = capacity;
+    table->loaded = 1;
+    table->changes = 0;
+    table->lastWritten = table->nextId - firstNewId;
+    table->lastTowns = towns;
+    free(buffer);
+    recordOperation(TIMER_SAVE, started);
+    return 1;
+}
+
+// Function to release the segment table
+void freeSegmentTable(SegmentTable *table) {
+    free(table->segments);
+    memset(table, 0, sizeof(*table));
+}
+
+// Function to release a hash table and its slot arrays
+void freeHashTable(HashTable *table) {
+    free(table->entries);
+    free(table->oldEntries);
+    free(atomic_load(&table->view));
+    free(table);
+    reclaimMemory(); // Retired slot arrays, no reader is left by now
+}
+
+// Function to print allocator counters and memory usage
+void printMemoryStats(HashTable *table) {
+    size_t slotBytes = ((size_t)table->capacity + table->oldCapacity) * sizeof(HashTableEntry);
+    struct rusage usage;
+
+    printf("Town nodes in use: %ld (%zu bytes each)\n", townPool.live, sizeof(Town));
+    printf("Town allocations: %ld, frees: %ld\n", townPool.allocations, townPool.frees);
+    printf("Town slabs: %ld (%zu bytes reserved)\n", townPool.slabCount, townPool.bytesReserved);
+    printf("Hash table slots: %d (%zu bytes)\n", table->capacity + table->oldCapacity, slotBytes);
+    printf("Retired slot arrays: %ld, freed after their readers left: %ld\n", reclaimer.retiredCount, reclaimer.reclaimedCount);
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        printf("Peak resident memory: %ld KB\n", usage.ru_maxrss);
+}
+
+// Function to print the slots of one array
+void printEntries(HashTableEntry *entries, int capacity) {
+    for (int i = 0; i < capacity; i++) {
+        printf("Index %d: ", i);
+        HashTableEntry *entry = &entries[i];
+        if (entry->isOccupied == SLOT_DELETED) {
+            printf("Deleted\n");
+        } else if (entry->isOccupied != SLOT_OCCUPIED) {
+            printf("Empty\n");
+        } else {
+            printf("%s -> ", entry->townData->town);
+            printf("NULL\n");
+        }
+    }
+}
+
+// Function to print the hash table
+void printHashedTable(HashTable *table) {
+    printf("Hashed Table:\n");
+    printEntries(table->entries, table->capacity);
+    if (table->oldEntries != NULL) {
+        printf("Slots still being migrated:\n");
+        printEntries(table->oldEntries, table->oldCapacity);
+    }
+}
+
+// Function to print hash table statistics
+void printHashTableStats(HashTable *table) {
+    printf("Size of hash table: %d\n", table->capacity);
+    printf("Number of towns: %d\n", table->count);
+    printf("Load factor: %.2f\n", (float)table->count / table->capacity);
+    printf("Maximum load factor: %.2f\n", table->maxLoadFactor);
+    printf("Number of resizes: %d\n", table->resizeCount);
+    printf("Deleted slots (tombstones): %d\n", table->tombstones);
+    printf("Number of compactions: %d\n", table->compactionCount);
+    if (table->oldEntries != NULL)
+        printf("Resize in progress: %d of %d old slots migrated\n", table->migrateIndex, table->oldCapacity);
+}
+
+// Function to search for a town in the hash table and print the number of collisions
+void searchTownInHashTable(HashTable *table, char *town) {
+    int collisions = 0;
+
+    // Linear probing to find the town
+    HashTableEntry *entry = findHashEntry(table, town, hash(town), &collisions);
+    if (entry != NULL) {
+        printf("Town found: %s\n", entry->townData->town);
+        printf("Number of collisions: %d\n", collisions);
+        return;
+    }
+
+    printf("Town not found.\n");
+}
+
+// Function to add the collisions of every town in one slot array to a histogram
+void collectCollisions(HashTable *table, HashTableEntry *entries, int capacity, int histogram[], int buckets, long *total, int *maxCollisions) {
+    for (int i = 0; i < capacity; i++) {
+        if (entries[i].isOccupied != SLOT_OCCUPIED)
+            continue;
+
+        // Count what searchTownInHashTable would report for this town
+        int collisions = 0;
+        probeHashTable(table, entries[i].townData->town, entries[i].hashValue, &collisions);
+
+        histogram[collisionBucket(collisions, buckets)]++;
+        *total += collisions;
+        if (collisions > *maxCollisions)
+            *maxCollisions = collisions;
+    }
+}
+
+// Function to print how many collisions a search for each stored town runs into
+void printCollisionReport(HashTable *table) {
+    enum { BUCKETS = 9 };
+    const char *labels[BUCKETS] = { "0", "1", "2", "3", "4-7", "8-15", "16-31", "32-63", "64+" };
+    int histogram[BUCKETS] = { 0 };
+    long total = 0;
+    int maxCollisions = 0;
+
+    collectCollisions(table, table->entries, table->capacity, histogram, BUCKETS, &total, &maxCollisions);
+    if (table->oldEntries != NULL)
+        collectCollisions(table, table->oldEntries, table->oldCapacity, histogram, BUCKETS, &total, &maxCollisions);
+
+    if (table->count == 0) {
+        printf("Hash table is empty.\n");
+        return;
+    }
+
+    printf("Collisions per successful search (%d towns):\n", table->count);
+    for (int i = 0; i < BUCKETS; i++)
+        printf("  %-6s %8d  (%5.1f%%)\n", labels[i], histogram[i], 100.0 * histogram[i] / table->count);
+
+    // Linear probing expects about (1 + 1/(1 - a)) / 2 probes per hit at load factor a
+    double load = (double)table->count / table->capacity;
+    printf("Average collisions: %.2f (expected %.2f at load factor %.2f)\n",
+           (double)total / table->count, (1.0 + 1.0 / (1.0 - load)) / 2.0 - 1.0, load);
+    printf("Maximum collisions: %d\n", maxCollisions);
+}
+
+#define MAX_REPORTED_LINES 20 // Bad input lines reported individually before summarizing
+
+// Define the structure used to sort towns while bulk loading
+typedef struct LoadedTown {
+    Town *town; // Parsed town node, not yet linked into the tree
+    int order;  // Position in the input, so the first copy of a duplicate wins
+} LoadedTown;
+
+// Function to order loaded towns by name, then by input position
+int compareLoadedTowns(const void *a, const void *b) {
+    const LoadedTown *x = (const LoadedTown*)a;
+    const LoadedTown *y = (const LoadedTown*)b;
+    int cmp = strcmp(x->town->town, y->town->town);
+    if (cmp != 0)
+        return cmp;
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// Function to sort loaded towns with compareLoadedTowns
+void sortLoadedTowns(LoadedTown *towns, int count) {
+    // Files written by saveToFile are already sorted, so only sort when needed
+    int sorted = 1;
+    for (int i = 1; i < count && sorted; i++) {
+        if (strcmp(towns[i - 1].town->town, towns[i].town->town) >= 0)
+            sorted = 0;
+    }
+    if (!sorted)
+        qsort(towns, count, sizeof(LoadedTown), compareLoadedTowns);
+}
+
+// Function to build a height-balanced AVL tree from towns sorted by name,
+// indexing each town in the hash table as it is linked in
+Town* buildBalancedTree(LoadedTown *towns, int count, HashTable *table) {
+    if (count == 0)
+        return NULL;
+
+    int mid = count / 2;
+    Town *node = towns[mid].town;
+    node->left = buildBalancedTree(towns, mid, table);
+    node->right = buildBalancedTree(towns + mid + 1, count - mid - 1, table);
+    updateTown(node);
+    insertIntoHashTable(table, node);
+    return node;
+}
+
+// Function to build the AVL tree and hash table in one pass from towns sorted
+// with compareLoadedTowns
+Town* bulkBuildSorted(LoadedTown *towns, int count, HashTable *table) {
+    // Drop later copies of a town, like insert() does
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(towns[unique - 1].town->town, towns[i].town->town) == 0)
+            freeTown(towns[i].town);
+        else
+            towns[unique++] = towns[i];
+    }
+
+    reserveHashTable(table, table->count + unique);
+    return buildBalancedTree(towns, unique, table);
+}
+
+// Function to build the AVL tree and hash table from sorted (or sortable) towns in one pass
+Town* bulkBuild(LoadedTown *towns, int count, HashTable *table) {
+    sortLoadedTowns(towns, count);
+    return bulkBuildSorted(towns, count, table);
+}
+
+// Function to find the next ':' or '\n' at or after p, or end if there is none
+static inline const char* nextDelimiter(const char *p, const char *end) {
+#ifdef __SSE2__
+    // Compare 16 bytes at a time against both delimiters
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, colon), _mm_cmpeq_epi8(block, newline)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != ':' && *p != '\n')
+        p++;
+    return p;
+}
+
+// Function to parse a decimal integer that fills [p, end) exactly
+int parseInteger(const char *p, const char *end, int *value) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p == end)
+        return 0;
+
+    long long result = 0;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9')
+            return 0;
+        result = result * 10 + (*p - '0');
+        if (result > (long long)INT_MAX + negative)
+            return 0; // Out of range for an int
+    }
+    *value = (int)(negative ? -result : result);
+    return 1;
+}
+
+// Function to copy a name field into a town, checking it fits
+int copyName(char *dest, size_t size, const char *p, const char *end) {
+    size_t length = end - p;
+    if (length == 0 || length >= size)
+        return 0;
+    memcpy(dest, p, length);
+    dest[length] = '\0';
+    return 1;
+}
+
+// Function to parse one "district:town:population:elevation:municipality" line
+// into a town, interning its district in `districts`; returns NULL on success
+// or a description of the problem
+const char* parseTownLine(const char *line, const char *end, Town *node, DistrictTable *districts) {
+    const char *fields[6]; // Start of each field, plus one past the last
+    int count = 0;
+
+    const char *p = line;
+    for (;;) {
+        fields[count++] = p;
+        p = nextDelimiter(p, end);
+        if (p == end || *p == '\n')
+            break;
+        if (count == 5)
+            return "too many fields";
+        p++; // Skip the ':'
+    }
+    if (count != 5)
+        return "expected 5 fields";
+    fields[5] = p + 1; // As if another field followed
+
+    // Ignore trailing whitespace and Windows line endings after the last field
+    while (p > fields[4] && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r'))
+        p--;
+
+    char district[50];
+    if (!copyName(district, sizeof(district), fields[0], fields[1] - 1))
+        return "district name is empty or too long";
+    if (!copyName(node->town, sizeof(node->town), fields[1], fields[2] - 1))
+        return "town name is empty or too long";
+    if (!parseInteger(fields[2], fields[3] - 1, &node->population))
+        return "population is not a valid number";
+    if (!parseInteger(fields[3], fields[4] - 1, &node->elevation))
+        return "elevation is not a valid number";
+
+    size_t length = p - fields[4];
+    if (length == 3 && strncasecmp(fields[4], "yes", 3) == 0)
+        node->hasMunicipality = 1;
+    else if (length == 2 && strncasecmp(fields[4], "no", 2) == 0)
+        node->hasMunicipality = 0;
+    else
+        return "municipality must be yes or no";
+
+    node->districtId = internDistrict(districts, district);
+    return NULL;
+}
+
+// Define the parallel loader: the file is cut into one chunk per thread at
+// line boundaries, every thread parses and sorts its own chunk with a private
+// district table, and the sorted chunks are merged pairwise before the AVL
+// tree and hash table are built from them in one pass
+#define MAX_LOAD_THREADS 64       // Most threads used to load a file
+#define LOAD_MIN_CHUNK (1 << 18)  // Bytes of input each extra thread needs to pay off
+
+typedef struct LoadChunk {
+    const char *data;        // First byte of the chunk, at the start of a line
+    const char *end;         // One past its last byte, right after a newline or at the end of the file
+    int lines;               // Lines in the chunk, so at most this many towns
+    int firstLine;           // Line number of the first line, for error messages
+    int firstOrder;          // Input position of the first line
+    Town *nodes;             // Pooled towns reserved for the chunk, one per line
+    LoadedTown *towns;       // Parsed towns, sorted by name once the chunk is done
+    int count;               // Number of parsed towns
+    DistrictTable districts; // Districts named in the chunk, under chunk-local ids
+    int *districtIds;        // Registry-wide id of each chunk-local id
+    int badLines;            // Lines that could not be parsed
+    int errorLines[MAX_REPORTED_LINES];     // Line numbers of the first bad lines
+    const char *errors[MAX_REPORTED_LINES]; // What was wrong with each of them
+} LoadChunk;
+
+// Define one merge of two sorted runs of towns into a third array
+typedef struct MergeTask {
+    LoadedTown *left;  // First run
+    int leftCount;
+    LoadedTown *right; // Second run, NULL when the first one is only copied
+    int rightCount;
+    LoadedTown *out;   // Room for both runs
+} MergeTask;
+
+// Function to run one loader stage over `count` tasks, each on its own thread.
+// The calling thread takes the first task, and a task whose thread cannot be
+// started runs inline, so a stage always completes.
+void runParallel(void *(*stage)(void*), void *tasks, size_t taskSize, int count) {
+    pthread_t threads[MAX_LOAD_THREADS];
+    int started[MAX_LOAD_THREADS];
+
+    for (int i = 1; i < count; i++) {
+        void *task = (char*)tasks + i * taskSize;
+        started[i] = pthread_create(&threads[i], NULL, stage, task) == 0;
+        if (!started[i])
+            stage(task);
+    }
+    if (count > 0)
+        stage(tasks);
+    for (int i = 1; i < count; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+// Function to count the lines of a chunk, including an unterminated last one
+void* countChunkLines(void *argument) {
+    LoadChunk *chunk = (LoadChunk*)argument;
+    int lines = 0;
+    for (const char *p = chunk->data; (p = memchr(p, '\n', chunk->end - p)) != NULL; p++)
+        lines++;
+    if (chunk->end > chunk->data && chunk->end[-1] != '\n')
+        lines++;
+    chunk->lines = lines;
+    return NULL;
+}
+
+// Function to parse every line of a chunk into its reserved towns and sort them.
+// Bad lines are recorded with their line number and skipped.
+void* parseChunk(void *argument) {
+    LoadChunk *chunk = (LoadChunk*)argument;
+    const char *p = chunk->data, *end = chunk->end;
+    int lineNumber = chunk->firstLine;
+
+    while (p < end) {
+        const char *lineEnd = memchr(p, '\n', end - p);
+        if (lineEnd == NULL)
+            lineEnd = end;
+
+        // Skip blank lines
+        const char *q = p;
+        while (q < lineEnd && (*q == ' ' || *q == '\t' || *q == '\r'))
+            q++;
+
+        if (q < lineEnd) {
+            Town *node = &chunk->nodes[chunk->count];
+            const char *error = parseTownLine(p, lineEnd, node, &chunk->districts);
+            if (error != NULL) {
+                if (chunk->badLines < MAX_REPORTED_LINES) {
+                    chunk->errorLines[chunk->badLines] = lineNumber;
+                    chunk->errors[chunk->badLines] = error;
+                }
+                chunk->badLines++;
+            } else {
+                chunk->towns[chunk->count].town = node;
+                chunk->towns[chunk->count].order = chunk->firstOrder + chunk->count;
+                chunk->count++;
+            }
+        }
+
+        p = lineEnd + 1;
+        lineNumber++;
+    }
+
+    sortLoadedTowns(chunk->towns, chunk->count);
+    return NULL;
+}
+
+// Function to give the towns of a chunk their registry-wide district ids
+void* remapChunkDistricts(void *argument) {
+    LoadChunk *chunk = (LoadChunk*)argument;
+    for (int i = 0; i < chunk->count; i++) {
+        Town *node = chunk->towns[i].town;
+        node->districtId = chunk->districtIds[node->districtId];
+    }
+    return NULL;
+}
+
+// Function to merge two sorted runs, taking from the left run on ties so the
+// first copy of a duplicate town stays first
+void* mergeRuns(void *argument) {
+    MergeTask *task = (MergeTask*)argument;
+    int i = 0, j = 0, k = 0;
+    while (i < task->leftCount && j < task->rightCount) {
+        if (compareLoadedTowns(&task->left[i], &task->right[j]) <= 0)
+            task->out[k++] = task->left[i++];
+        else
+            task->out[k++] = task->right[j++];
+    }
+    memcpy(task->out + k, task->left + i, (task->leftCount - i) * sizeof(LoadedTown));
+    k += task->leftCount - i;
+    memcpy(task->out + k, task->right + j, (task->rightCount - j) * sizeof(LoadedTown));
+    return NULL;
+}
+
+// Function to load every town in a file into an empty AVL tree and hash table,
+// parsing it on up to `threads` threads
+Town* loadTownFile(const char *path, HashTable *table, int threads) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size == 0) {
+        close(fd);
+        return NULL; // Nothing to load
+    }
+
+    // Map the whole file and parse it in place
+    size_t size = info.st_size;
+    char *data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        return NULL;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    // Small files are not worth a thread per core
+    if (threads > MAX_LOAD_THREADS)
+        threads = MAX_LOAD_THREADS;
+    if ((size_t)threads > size / LOAD_MIN_CHUNK + 1)
+        threads = size / LOAD_MIN_CHUNK + 1;
+    if (threads < 1)
+        threads = 1;
+
+    LoadChunk *chunks = (LoadChunk*)calloc(threads, sizeof(LoadChunk));
+    if (chunks == NULL) {
+        printf("Memory allocation failed!\n");
+        munmap(data, size);
+        return NULL;
+    }
+
+    // Cut the file into chunks of about the same size that end at a newline
+    const char *p = data, *end = data + size;
+    int chunkCount = 0;
+    for (int i = 0; i < threads && p < end; i++) {
+        const char *chunkEnd = i == threads - 1 ? end : data + size / threads * (i + 1);
+        if (chunkEnd < p)
+            chunkEnd = p;
+        if (chunkEnd < end) {
+            const char *newline = memchr(chunkEnd, '\n', end - chunkEnd);
+            chunkEnd = newline != NULL ? newline + 1 : end;
+        }
+        chunks[chunkCount].data = p;
+        chunks[chunkCount].end = chunkEnd;
+        chunkCount++;
+        p = chunkEnd;
+    }
+
+    // Count the lines of every chunk, then reserve one town per line up front
+    runParallel(countChunkLines, chunks, sizeof(LoadChunk), chunkCount);
+    int lines = 0;
+    for (int i = 0; i < chunkCount; i++) {
+        chunks[i].firstLine = lines + 1;
+        chunks[i].firstOrder = lines;
+        lines += chunks[i].lines;
+    }
+
+    LoadedTown *towns = (LoadedTown*)malloc(lines * sizeof(LoadedTown));
+    LoadedTown *scratch = (LoadedTown*)malloc(lines * sizeof(LoadedTown));
+    if (towns == NULL || scratch == NULL) {
+        printf("Memory allocation failed!\n");
+        free(towns);
+        free(scratch);
+        free(chunks);
+        munmap(data, size);
+        return NULL;
+    }
+    Town *nodes = allocTownRun(lines);
+    for (int i = 0; i < chunkCount; i++) {
+        chunks[i].nodes = nodes + chunks[i].firstOrder;
+        chunks[i].towns = towns + chunks[i].firstOrder;
+    }
+
+    runParallel(parseChunk, chunks, sizeof(LoadChunk), chunkCount);
+    munmap(data, size);
+
+    // Report the bad lines in file order
+    int badLines = 0, reported = 0;
+    for (int i = 0; i < chunkCount; i++) {
+        for (int j = 0; j < chunks[i].badLines && j < MAX_REPORTED_LINES && reported < MAX_REPORTED_LINES; j++, reported++)
+            printf("Line %d: %s\n", chunks[i].errorLines[j], chunks[i].errors[j]);
+        badLines += chunks[i].badLines;
+    }
+    if (badLines > MAX_REPORTED_LINES)
+        printf("... and %d more bad lines\n", badLines - MAX_REPORTED_LINES);
+    if (badLines > 0)
+        printf("Skipped %d bad lines in %s\n", badLines, path);
+
+    // Intern the districts of every chunk in the registry and renumber the towns
+    for (int i = 0; i < chunkCount; i++) {
+        chunks[i].districtIds = (int*)malloc((chunks[i].districts.count + 1) * sizeof(int));
+        if (chunks[i].districtIds == NULL) {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        for (int d = 0; d < chunks[i].districts.count; d++)
+            chunks[i].districtIds[d] = internDistrict(&districts, chunks[i].districts.names[d]);
+    }
+    runParallel(remapChunkDistricts, chunks, sizeof(LoadChunk), chunkCount);
+
+    // Give back the towns reserved for blank and bad lines
+    LoadedTown *runs[MAX_LOAD_THREADS];
+    int runCounts[MAX_LOAD_THREADS];
+    for (int i = 0; i < chunkCount; i++) {
+        for (int j = chunks[i].count; j < chunks[i].lines; j++)
+            freeTown(&chunks[i].nodes[j]);
+        runs[i] = chunks[i].towns;
+        runCounts[i] = chunks[i].count;
+        free(chunks[i].districtIds);
+        clearDistrictTable(&chunks[i].districts);
+    }
+
+    // Merge the sorted chunks pairwise, alternating between the two arrays
+    MergeTask tasks[MAX_LOAD_THREADS];
+    LoadedTown *target = scratch, *other = towns;
+    int runCount = chunkCount;
+    while (runCount > 1) {
+        int merges = (runCount + 1) / 2, offset = 0;
+        for (int m = 0; m < merges; m++) {
+            int hasRight = 2 * m + 1 < runCount;
+            tasks[m].left = runs[2 * m];
+            tasks[m].leftCount = runCounts[2 * m];
+            tasks[m].right = hasRight ? runs[2 * m + 1] : NULL;
+            tasks[m].rightCount = hasRight ? runCounts[2 * m + 1] : 0;
+            tasks[m].out = target + offset;
+            runs[m] = target + offset;
+            runCounts[m] = tasks[m].leftCount + tasks[m].rightCount;
+            offset += runCounts[m];
+        }
+        runParallel(mergeRuns, tasks, sizeof(MergeTask), merges);
+
+        runCount = merges;
+        LoadedTown *swap = target;
+        target = other;
+        other = swap;
+    }
+
+    Town *root = bulkBuildSorted(runs[0], runCounts[0], table);
+    free(towns);
+    free(scratch);
+    free(chunks);
+    return root;
+}
+
+// Define the binary snapshot format: a header, a string table with every
+// district name (NUL terminated, in id order, zero padded to a multiple of
+// 8 bytes so the records stay aligned), then one fixed-width record
+// per town in alphabetical order. Integers use the host byte order, which
+// the header records so a foreign snapshot is rejected instead of misread.
+#define SNAPSHOT_FILE "towns.snap"
+#define SNAPSHOT_MAGIC "TOWNSNAP"
+#define SNAPSHOT_VERSION 3 // Version 2 stored the municipality status as text
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct SnapshotHeader {
+    char magic[8];             // SNAPSHOT_MAGIC
+    uint32_t version;          // SNAPSHOT_VERSION
+    uint32_t byteOrder;        // SNAPSHOT_BYTE_ORDER as written by the saving host
+    uint32_t recordCount;      // Number of town records
+    uint32_t districtCount;    // Number of names in the string table
+    uint32_t stringTableBytes; // Size of the string table
+    uint32_t reserved;         // Always zero
+    uint64_t generation;       // Bumped by every compaction, matched against the change log
+    uint64_t checksum;         // checksum64 of the string table and the records
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    int32_t population;     // Population of the town
+    int32_t elevation;      // Elevation of the town
+    uint32_t districtId;    // Index into the string table
+    char town[50];          // Name of the town, NUL padded
+    uint8_t hasMunicipality; // 1 if the town has a municipality, 0 if not
+    uint8_t padding;        // Always zero
+} SnapshotRecord;
+
+_Static_assert(sizeof(SnapshotHeader) == 48, "snapshot header must stay fixed width");
+_Static_assert(sizeof(SnapshotRecord) == 64, "snapshot records must stay fixed width");
+
+// Function to checksum a buffer 8 bytes at a time, continuing from `state`
+uint64_t checksum64(const void *data, size_t size, uint64_t state) {
+    const unsigned char *p = (const unsigned char*)data;
+    uint64_t word;
+    while (size >= 8) {
+        memcpy(&word, p, 8);
+        state = rotl64((state ^ word) * 0x87c37b91114253d5ULL, 31);
+        p += 8;
+        size -= 8;
+    }
+    word = 0;
+    memcpy(&word, p, size);
+    state = rotl64((state ^ word ^ size) * 0x4cf5ad432745937fULL, 29);
+    return mix64(state);
+}
+
+// Function to turn the AVL tree into snapshot records in alphabetical order
+void collectSnapshotRecords(Town *root, SnapshotRecord *records) {
+    TownCursor cursor;
+    cursorInit(&cursor, root, ORDER_BY_NAME);
+    for (Town *node = cursorFirst(&cursor); node != NULL; node = cursorNext(&cursor)) {
+        SnapshotRecord *record = records++;
+        memset(record, 0, sizeof(*record));
+        record->population = node->population;
+        record->elevation = node->elevation;
+        record->districtId = node->districtId;
+        strcpy(record->town, node->town);
+        record->hasMunicipality = node->hasMunicipality;
+    }
+}
+
+// Function to save the AVL tree as a binary snapshot, replacing the old one atomically
+int saveSnapshot(const char *path, Town *root, uint64_t generation) {
+    uint64_t started = monotonicNanoseconds();
+    uint32_t count = subtreeSize(root);
+    SnapshotRecord *records = (SnapshotRecord*)malloc((count + 1) * sizeof(SnapshotRecord));
+    if (records == NULL) {
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+    collectSnapshotRecords(root, records);
+
+    // Lay out the string table from the district table, so record ids need no translation
+    size_t stringTableBytes = 0;
+    for (int i = 0; i < districts.count; i++)
+        stringTableBytes += strlen(districts.names[i]) + 1;
+    stringTableBytes = (stringTableBytes + 7) & ~(size_t)7;
+    char *strings = (char*)calloc(stringTableBytes + 1, 1);
+    if (strings == NULL) {
+        printf("Memory allocation failed!\n");
+        free(records);
+        return 0;
+    }
+    char *p = strings;
+    for (int i = 0; i < districts.count; i++) {
+        size_t length = strlen(districts.names[i]) + 1;
+        memcpy(p, districts.names[i], length);
+        p += length;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.recordCount = count;
+    header.districtCount = districts.count;
+    header.stringTableBytes = stringTableBytes;
+    header.generation = generation;
+    header.checksum = checksum64(records, (size_t)count * sizeof(SnapshotRecord),
+                                 checksum64(strings, stringTableBytes, 0));
+
+    // Write a temporary file and rename it over the old snapshot
+    char tempPath[256];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 &&
+             writeAll(fd, &header, sizeof(header)) &&
+             writeAll(fd, strings, stringTableBytes) &&
+             writeAll(fd, records, (size_t)count * sizeof(SnapshotRecord)) &&
+             fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0)
+        ok = 0;
+    if (ok && rename(tempPath, path) != 0)
+        ok = 0;
+    if (!ok) {
+        perror("Error writing snapshot");
+        unlink(tempPath);
+    }
+
+    free(strings);
+    free(records);
+    recordOperation(TIMER_SAVE, started);
+    return ok;
+}
+
+// Function to check a mapped snapshot and rebuild the AVL tree and hash table from it.
+// Returns 1 and sets *root on success, 0 if the snapshot is damaged.
+int restoreSnapshotData(const char *data, size_t size, HashTable *table, Town **root, uint64_t *generation) {
+    SnapshotHeader header;
+    if (size < sizeof(header)) {
+        printf("Snapshot is truncated.\n");
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.byteOrder != SNAPSHOT_BYTE_ORDER) {
+        printf("Not a snapshot written by this program.\n");
+        return 0;
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        printf("Unsupported snapshot version %u.\n", header.version);
+        return 0;
+    }
+
+    size_t recordBytes = (size_t)header.recordCount * sizeof(SnapshotRecord);
+    if (header.stringTableBytes % 8 != 0 || size != sizeof(header) + header.stringTableBytes + recordBytes) {
+        printf("Snapshot size does not match its header.\n");
+        return 0;
+    }
+    const char *strings = data + sizeof(header);
+    const SnapshotRecord *records = (const SnapshotRecord*)(strings + header.stringTableBytes);
+    if (checksum64(records, recordBytes, checksum64(strings, header.stringTableBytes, 0)) != header.checksum) {
+        printf("Snapshot checksum mismatch.\n");
+        return 0;
+    }
+
+    // Intern each district name of the string table
+    int *districtIds = (int*)malloc((header.districtCount + 1) * sizeof(int));
+    LoadedTown *towns = (LoadedTown*)malloc((header.recordCount + 1) * sizeof(LoadedTown));
+    if (districtIds == NULL || towns == NULL) {
+        printf("Memory allocation failed!\n");
+        free(districtIds);
+        free(towns);
+        return 0;
+    }
+    const char *p = strings, *end = strings + header.stringTableBytes;
+    for (uint32_t i = 0; i < header.districtCount; i++) {
+        const char *nul = p < end ? memchr(p, '\0', end - p) : NULL;
+        if (nul == NULL || nul - p >= 50) {
+            printf("Snapshot string table is damaged.\n");
+            free(districtIds);
+            free(towns);
+            return 0;
+        }
+        districtIds[i] = internDistrict(&districts, p);
+        p = nul + 1;
+    }
+
+    // Turn each record back into a pooled town node
+    reserveTowns(header.recordCount);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < header.recordCount; i++) {
+        const SnapshotRecord *record = &records[i];
+        if (record->districtId >= header.districtCount ||
+            memchr(record->town, '\0', sizeof(record->town)) == NULL || record->hasMunicipality > 1) {
+            printf("Snapshot record %u is damaged, skipping it.\n", i + 1);
+            continue;
+        }
+        Town *node = allocTown();
+        node->districtId = districtIds[record->districtId];
+        strcpy(node->town, record->town);
+        node->population = record->population;
+        node->elevation = record->elevation;
+        node->hasMunicipality = record->hasMunicipality;
+        towns[count].town = node;
+        towns[count].order = count;
+        count++;
+    }
+
+    *root = bulkBuild(towns, count, table); // Records are already sorted, so this is one linear pass
+    *generation = header.generation;
+    free(districtIds);
+    free(towns);
+    return 1;
+}
+
+// Function to restore the AVL tree and hash table from a binary snapshot.
+// Returns 1 on success, 0 if the file is damaged or unreadable, -1 if it is missing.
+int loadSnapshot(const char *path, HashTable *table, Town **root, uint64_t *generation) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return -1;
+        perror("Error opening snapshot");
+        return 0;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size == 0) {
+        printf("Snapshot is empty.\n");
+        close(fd);
+        return 0;
+    }
+
+    size_t size = info.st_size;
+    char *data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping snapshot");
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    int ok = restoreSnapshotData(data, size, table, root, generation);
+    munmap(data, size);
+    return ok;
+}
+
+// Define the write-ahead log: every insert, update and delete since the
+// last snapshot is appended to towns.wal as a fixed-width, checksummed
+// record. Startup replays the log on top of the snapshot it belongs to,
+// and compaction folds it into a new snapshot.
+#define LOG_FILE "towns.wal"
+#define LOG_MAGIC "TOWNWAL2" // TOWNWAL1 logs stored the municipality status as text
+#define LOG_GROUP_SIZE 64            // Records per group commit by default
+#define LOG_COMPACT_MIN_RECORDS 4096 // Log length before automatic compaction is considered
+
+// Operations stored in LogRecord.op
+#define LOG_INSERT 1
+#define LOG_UPDATE 2
+#define LOG_DELETE 3
+
+// When appended records reach the disk
+#define LOG_SYNC_ALWAYS 0 // fsync after every record
+#define LOG_SYNC_GROUP 1  // fsync once per group of records or per commit
+#define LOG_SYNC_NONE 2   // leave flushing to the operating system
+
+typedef struct LogHeader {
+    char magic[8];       // LOG_MAGIC
+    uint64_t generation; // Generation of the snapshot this log applies to
+} LogHeader;
+
+typedef struct LogRecord {
+    uint32_t checksum;       // Low 32 bits of checksum64 over the rest of the record
+    uint32_t op;             // LOG_INSERT, LOG_UPDATE or LOG_DELETE
+    int32_t population;      // New population (unused for deletes)
+    int32_t elevation;       // New elevation (unused for deletes)
+    char district[50];       // District of the town (unused for deletes)
+    char town[50];           // Name of the town
+    uint8_t hasMunicipality; // New municipality status, 1 or 0 (unused for deletes)
+    uint8_t reserved[3];     // Zero
+} LogRecord;
+
+_Static_assert(sizeof(LogHeader) == 16, "log header must stay fixed width");
+_Static_assert(sizeof(LogRecord) == 120, "log records must stay fixed width");
+
+typedef struct WriteAheadLog {
+    int fd;                // Open log file
+    uint64_t generation;   // Snapshot generation the log applies to
+    int syncPolicy;        // LOG_SYNC_ALWAYS, LOG_SYNC_GROUP or LOG_SYNC_NONE
+    int groupSize;         // Records buffered before a group commit
+    LogRecord *pending;    // Records appended but not yet written
+    int pendingCount;      // Number of records in pending
+    long records;          // Records in the log file since the last compaction
+    long commits;          // Group commits written so far
+    long syncs;            // fsync calls made so far
+} WriteAheadLog;
+
+// Define the lookup cache in front of the registry's indexes. It is set
+// associative: a town can only be kept in the CACHE_WAYS slots of the set its
+// hash selects, so a lookup reads one or two cache lines. A count-min sketch
+// estimates how often each name has been asked for lately, cached or not. A
+// miss only displaces the coldest town of its set when the new name has been
+// asked for more often, so a stream of one-off lookups cannot flush the hot
+// towns out.
+#define CACHE_SETS 256    // Sets in the cache (a power of two)
+#define CACHE_WAYS 4      // Towns per set
+#define SKETCH_ROWS 4     // Counters bumped per lookup, one per row
+#define SKETCH_WIDTH 4096 // Counters per row (a power of two)
+#define SKETCH_MAX 15     // Counters stop growing here
+#define SKETCH_AGING (10 * CACHE_SETS * CACHE_WAYS) // Lookups between halvings of every counter
+
+typedef struct CacheEntry {
+    Town *town;             // Cached town, NULL for a free way
+    unsigned int hashValue; // hash() of its name
+} CacheEntry;
+
+typedef struct LookupCache {
+    CacheEntry sets[CACHE_SETS][CACHE_WAYS];
+    unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH]; // Recent lookups per name, approximately
+    long lookups;       // Lookups since the sketch was last halved
+    long hits;          // Lookups answered from the cache
+    long misses;        // Lookups that went on to the indexes
+    long admissions;    // Missed towns that were cached
+    long rejections;    // Missed towns colder than every town of their set
+    long invalidations; // Cached towns dropped because they were deleted
+} LookupCache;
+
+// Function to get the sketch counter of a name in one row
+static inline unsigned char* sketchCounter(LookupCache *cache, unsigned int hashValue, int row) {
+    uint64_t mixed = mix64(hashValue); // Independent of the low bits that pick the set
+    return &cache->sketch[row][(mixed >> (12 * row)) & (SKETCH_WIDTH - 1)];
+}
+
+// Function to estimate how often a name has been looked up lately
+int sketchEstimate(LookupCache *cache, unsigned int hashValue) {
+    int estimate = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        int count = *sketchCounter(cache, hashValue, row);
+        if (count < estimate)
+            estimate = count;
+    }
+    return estimate;
+}
+
+// Function to count a lookup of a name, halving every counter now and then so old popularity fades
+void sketchRecord(LookupCache *cache, unsigned int hashValue) {
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        unsigned char *counter = sketchCounter(cache, hashValue, row);
+        if (*counter < SKETCH_MAX)
+            (*counter)++;
+    }
+    if (++cache->lookups == SKETCH_AGING) {
+        for (int row = 0; row < SKETCH_ROWS; row++)
+            for (int i = 0; i < SKETCH_WIDTH; i++)
+                cache->sketch[row][i] >>= 1;
+        cache->lookups = 0;
+    }
+}
+
+// Function to look a town up in the cache; returns NULL on a miss
+Town* cacheLookup(LookupCache *cache, char town[], unsigned int hashValue) {
+    CacheEntry *set = cache->sets[hashValue & (CACHE_SETS - 1)];
+    sketchRecord(cache, hashValue);
+    for (int way = 0; way < CACHE_WAYS; way++) {
+        if (set[way].town != NULL && set[way].hashValue == hashValue && strcmp(set[way].town->town, town) == 0) {
+            cache->hits++;
+            return set[way].town;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+// Function to offer a town that missed the cache; it takes a free way, or the
+// way of the coldest town in its set if it has been looked up more often
+void cacheAdmit(LookupCache *cache, Town *town, unsigned int hashValue) {
+    CacheEntry *set = cache->sets[hashValue & (CACHE_SETS - 1)];
+    int victim = 0, victimEstimate = INT_MAX;
+    for (int way = 0; way < CACHE_WAYS && victimEstimate >= 0; way++) {
+        int estimate = set[way].town != NULL ? sketchEstimate(cache, set[way].hashValue) : -1; // A free way always wins
+        if (estimate < victimEstimate) {
+            victim = way;
+            victimEstimate = estimate;
+        }
+    }
+    if (victimEstimate >= 0 && sketchEstimate(cache, hashValue) <= victimEstimate) {
+        cache->rejections++;
+        return;
+    }
+    set[victim].town = town;
+    set[victim].hashValue = hashValue;
+    cache->admissions++;
+}
+
+// Function to drop a town from the cache before it is freed
+void cacheForget(LookupCache *cache, Town *town, unsigned int hashValue) {
+    CacheEntry *set = cache->sets[hashValue & (CACHE_SETS - 1)];
+    for (int way = 0; way < CACHE_WAYS; way++) {
+        if (set[way].town == town) {
+            set[way].town = NULL;
+            cache->invalidations++;
+        }
+    }
+}
+
+// Define the engines that can serve name lookups and alphabetical listings
+#define ENGINE_AVL 0   // The AVL tree alone
+#define ENGINE_BTREE 1 // A B+-tree kept next to the AVL tree, which still answers rank and range-count queries
+
+// Define the structure tying the town indexes and their persistence together
+typedef struct Registry {
+    Town *root;           // AVL tree of towns ordered by name
+    int engine;           // ENGINE_AVL or ENGINE_BTREE, chosen at startup
+    BTree nameTree;       // B+-tree of towns ordered by name, empty unless engine is ENGINE_BTREE
+    LookupCache cache;    // Recently looked up towns, in front of the indexes
+    SegmentTable segments; // Segments of the saved town list and which of them are out of date
+    NgramIndex ngrams;    // Grams of every town name, for fuzzy search
+    Town *populationRoot; // Population index threaded through the same nodes
+    HashTable *hashTable; // Hash index of towns by name
+    BitmapIndex bitmaps;  // Municipality and district bitmaps over town rows
+    ColumnStore columns;  // Columnar copy of the town fields over the same rows
+    WriteAheadLog *log;   // Change log (NULL while the log is being replayed)
+    uint64_t generation;  // Generation of the snapshot the registry was loaded from
+    pthread_mutex_t writeLock; // Held by the one thread allowed to change the registry
+    atomic_uint sequence;      // Odd while a change is being made, bumped twice per change
+    atomic_long readRetries;   // Lock-free lookups that overlapped a change and started over
+} Registry;
+
+// Function to write the pending records to the log, syncing them if the policy asks for it
+int commitLog(WriteAheadLog *log) {
+    if (log->pendingCount == 0)
+        return 1;
+
+    int ok = writeAll(log->fd, log->pending, (size_t)log->pendingCount * sizeof(LogRecord));
+    if (ok && log->syncPolicy != LOG_SYNC_NONE) {
+        ok = fsync(log->fd) == 0;
+        log->syncs++;
+    }
+    if (!ok)
+        perror("Error writing change log");
+
+    log->records += log->pendingCount;
+    log->pendingCount = 0;
+    log->commits++;
+    return ok;
+}
+
+// Function to append one change to the log
+void appendLog(WriteAheadLog *log, int op, Town *node, char *town) {
+    LogRecord *record = &log->pending[log->pendingCount++];
+    memset(record, 0, sizeof(*record));
+    record->op = op;
+    strcpy(record->town, town);
+    if (node != NULL) {
+        record->population = node->population;
+        record->elevation = node->elevation;
+        strcpy(record->district, districtName(node->districtId));
+        record->hasMunicipality = node->hasMunicipality;
+    }
+    record->checksum = (uint32_t)checksum64((char*)record + sizeof(record->checksum),
+                                            sizeof(*record) - sizeof(record->checksum), 0);
+
+    if (log->syncPolicy == LOG_SYNC_ALWAYS || log->pendingCount == log->groupSize)
+        commitLog(log);
+}
+
+// Function to start a new, empty log for the given snapshot generation, replacing the old one atomically
+int resetLog(WriteAheadLog *log, uint64_t generation) {
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.generation = generation;
+
+    char tempPath[256];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", LOG_FILE);
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0 || !writeAll(fd, &header, sizeof(header)) || fsync(fd) != 0 || rename(tempPath, LOG_FILE) != 0) {
+        perror("Error creating change log");
+        if (fd >= 0)
+            close(fd);
+        unlink(tempPath);
+        return 0;
+    }
+
+    if (log->fd >= 0)
+        close(log->fd);
+    log->fd = fd;
+    log->generation = generation;
+    log->records = 0;
+    return 1;
+}
+
+// Function to apply one logged change to the registry
+void applyLogRecord(Registry *registry, const LogRecord *record);
+
+// Function to move a log that must not be replayed out of the way, keeping
+// its changes for inspection; exits if it cannot be moved
+void moveLogAside(void) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.orphan", LOG_FILE);
+    for (int i = 2; access(path, F_OK) == 0; i++)
+        snprintf(path, sizeof(path), "%s.orphan.%d", LOG_FILE, i); // Never overwrite an earlier orphan
+    if (rename(LOG_FILE, path) != 0) {
+        perror("Error moving change log aside");
+        exit(1);
+    }
+    printf("Moved %s to %s, its changes were not replayed.\n", LOG_FILE, path);
+}
+
+// Function to replay the log on top of the freshly loaded registry and open it for appending
+WriteAheadLog* openLog(Registry *registry, int syncPolicy, int groupSize) {
+    WriteAheadLog *log = (WriteAheadLog*)calloc(1, sizeof(WriteAheadLog));
+    if (log != NULL)
+        log->pending = (LogRecord*)malloc((groupSize > 0 ? groupSize : 1) * sizeof(LogRecord));
+    if (log == NULL || log->pending == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    log->fd = -1;
+    log->syncPolicy = syncPolicy;
+    log->groupSize = groupSize > 0 ? groupSize : 1;
+
+    int fd = open(LOG_FILE, O_RDWR | O_APPEND);
+    if (fd < 0) {
+        if (!resetLog(log, registry->generation))
+            exit(1);
+        return log;
+    }
+
+    struct stat info;
+    LogHeader header;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0) {
+        printf("%s is not a change log this program can read.\n", LOG_FILE);
+        close(fd);
+        moveLogAside();
+        if (!resetLog(log, registry->generation))
+            exit(1);
+        return log;
+    }
+    if (header.generation != registry->generation) {
+        // An older log was already compacted into the snapshot and can go. A
+        // newer one belongs to a snapshot that is gone: its changes must not
+        // be replayed on top of this state, nor thrown away.
+        close(fd);
+        if (header.generation > registry->generation) {
+            printf("%s belongs to a newer snapshot than the one loaded.\n", LOG_FILE);
+            moveLogAside();
+        }
+        if (!resetLog(log, registry->generation))
+            exit(1);
+        return log;
+    }
+
+    // Replay every complete record with a valid checksum
+    size_t size = info.st_size;
+    char *data = size > sizeof(header) ? (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (data == MAP_FAILED) {
+        perror("Error mapping change log");
+        exit(1);
+    }
+    size_t offset = sizeof(header);
+    long replayed = 0;
+    while (offset + sizeof(LogRecord) <= size) {
+        LogRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        uint32_t checksum = (uint32_t)checksum64((char*)&record + sizeof(record.checksum),
+                                                 sizeof(record) - sizeof(record.checksum), 0);
+        if (checksum != record.checksum || memchr(record.town, '\0', sizeof(record.town)) == NULL)
+            break; // A torn write at the end of the log
+        applyLogRecord(registry, &record);
+        offset += sizeof(record);
+        replayed++;
+    }
+    if (data != NULL)
+        munmap(data, size);
+
+    // Drop a torn tail so new records follow the last good one
+    if (offset != size) {
+        printf("Discarding %zu bytes of incomplete changes at the end of %s\n", size - offset, LOG_FILE);
+        if (ftruncate(fd, offset) != 0)
+            perror("Error truncating change log");
+    }
+    if (replayed > 0)
+        printf("Replayed %ld changes from %s\n", replayed, LOG_FILE);
+
+    log->fd = fd;
+    log->generation = header.generation;
+    log->records = replayed;
+    return log;
+}
+
+// Function to flush and close the log
+void closeLog(WriteAheadLog *log) {
+    commitLog(log);
+    if (log->syncPolicy == LOG_SYNC_NONE)
+        fsync(log->fd);
+    close(log->fd);
+    free(log->pending);
+    free(log);
+}
+
+// Function to take the writer lock. Every change to the registry is made by
+// the thread holding it; lock-free readers go through registryLookup instead.
+void registryLockWriter(Registry *registry) {
+    pthread_mutex_lock(&registry->writeLock);
+}
+
+// Function to drop the writer lock, first freeing the memory readers have let go of
+void registryUnlockWriter(Registry *registry) {
+    reclaimMemory();
+    pthread_mutex_unlock(&registry->writeLock);
+}
+
+// Function to mark the start of a change: readers that overlap it start over
+static inline void beginChange(Registry *registry) {
+    atomic_store_explicit(&registry->sequence, atomic_load_explicit(&registry->sequence, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // The odd count is visible before any change is
+}
+
+// Function to mark the end of a change
+static inline void endChange(Registry *registry) {
+    atomic_store_explicit(&registry->sequence, atomic_load_explicit(&registry->sequence, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+// Function to compare the name of a town a writer may be changing, one relaxed
+// atomic load per byte; like strncmp, at most sizeof(node->town) bytes are compared
+static int townNameEqualsUnlocked(Town *node, const char *town) {
+    for (size_t i = 0; i < sizeof(node->town); i++) {
+        char c = __atomic_load_n(&node->town[i], __ATOMIC_RELAXED);
+        if (c != town[i])
+            return 0;
+        if (c == '\0')
+            break;
+    }
+    return 1;
+}
+
+// Function to copy the fields of a town a writer may be changing with relaxed
+// atomic loads; its row and tree links mean nothing to the caller and are left zero
+static void copyTownUnlocked(Town *copy, Town *node) {
+    memset(copy, 0, sizeof(Town));
+    copy->districtId = __atomic_load_n(&node->districtId, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < sizeof(node->town); i++)
+        copy->town[i] = __atomic_load_n(&node->town[i], __ATOMIC_RELAXED);
+    copy->town[sizeof(copy->town) - 1] = '\0'; // A torn copy is thrown away, but must stay a string
+    copy->population = __atomic_load_n(&node->population, __ATOMIC_RELAXED);
+    copy->elevation = __atomic_load_n(&node->elevation, __ATOMIC_RELAXED);
+    copy->hasMunicipality = __atomic_load_n(&node->hasMunicipality, __ATOMIC_RELAXED);
+}
+
+// Function to find a town in a slot array that a writer may be changing underneath:
+// every read stays inside the array, slot fields and names are read with relaxed
+// atomic loads, and the caller throws the answer away if a change overlapped it
+static Town* probeEntriesUnlocked(HashTableEntry *entries, int capacity, char *town, unsigned int hashValue) {
+    unsigned int mask = capacity - 1;
+    unsigned int index = hashValue & mask;
+    for (int probed = 0; probed < capacity; probed++) {
+        HashTableEntry *entry = &entries[index];
+        int state = __atomic_load_n(&entry->isOccupied, __ATOMIC_RELAXED);
+        if (state == SLOT_EMPTY)
+            break;
+
+        // A town the writer has just recycled is still pool memory, so reading its name is safe
+        Town *townData = __atomic_load_n(&entry->townData, __ATOMIC_RELAXED);
+        if (state == SLOT_OCCUPIED && __atomic_load_n(&entry->hashValue, __ATOMIC_RELAXED) == hashValue &&
+            townData != NULL && townNameEqualsUnlocked(townData, town))
+            return townData;
+        index = (index + 1) & mask;
+    }
+    return NULL;
+}
+
+// Function to look up a town from any thread without taking the writer lock.
+// The hash index is read under a sequence lock: a read that overlaps a change
+// is retried, and slot arrays dropped by a resize outlive every reader through
+// the epoch reclaimer. Copies the town's fields into *copy and returns 1, or
+// returns 0 if the town is not registered.
+int registryLookup(Registry *registry, char town[], Town *copy) {
+    unsigned int hashValue = hash(town);
+    HashTable *table = registry->hashTable;
+
+    int slot = acquireReaderSlot();
+    if (slot < 0) {
+        // Every reader slot is taken: fall back to the writer lock
+        registryLockWriter(registry);
+        HashTableEntry *entry = findHashEntry(table, town, hashValue, NULL);
+        if (entry != NULL)
+            copyTownUnlocked(copy, entry->townData);
+        registryUnlockWriter(registry);
+        return entry != NULL;
+    }
+
+    enterReadSection(slot);
+    Town *node;
+    for (;;) {
+        unsigned int sequence = atomic_load_explicit(&registry->sequence, memory_order_acquire);
+        if (sequence & 1) {
+            sched_yield(); // A change is in progress
+            continue;
+        }
+
+        // Probe the published slot arrays and copy the town out before checking that nothing changed
+        HashTableView *view = atomic_load_explicit(&table->view, memory_order_acquire);
+        node = probeEntriesUnlocked(view->entries, view->capacity, town, hashValue);
+        if (node == NULL && view->oldEntries != NULL)
+            node = probeEntriesUnlocked(view->oldEntries, view->oldCapacity, town, hashValue);
+        if (node != NULL)
+            copyTownUnlocked(copy, node);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&registry->sequence, memory_order_relaxed) == sequence)
+            break;
+        atomic_fetch_add_explicit(&registry->readRetries, 1, memory_order_relaxed);
+    }
+    leaveReadSection(slot);
+    return node != NULL;
+}
+
+// Function to add a new town to the registry; returns NULL if it already exists.
+// Like every change below, it must be made with the writer lock held.
+Town* registryInsertTown(Registry *registry, int districtId, char town[], int population, int elevation, int hasMunicipality) {
+    uint64_t started = monotonicNanoseconds();
+    Town *node;
+
+    beginChange(registry);
+    registry->root = insert(registry->root, districtId, town, population, elevation, hasMunicipality, &node);
+    if (node == NULL) {
+        endChange(registry);
+        recordOperation(TIMER_INSERT, started);
+        return NULL;
+    }
+    insertIntoHashTable(registry->hashTable, node);
+    if (registry->engine == ENGINE_BTREE)
+        btreeInsert(&registry->nameTree, node);
+    registry->populationRoot = populationInsert(registry->populationRoot, node);
+    bitmapAddTown(&registry->bitmaps, node);
+    ngramAddTown(&registry->ngrams, node);
+    columnsStoreTown(&registry->columns, &registry->bitmaps, node);
+    endChange(registry);
+    markSegmentDirty(&registry->segments, town, 1);
+    if (registry->log != NULL)
+        appendLog(registry->log, LOG_INSERT, node, town);
+    recordOperation(TIMER_INSERT, started);
+    return node;
+}
+
+// Function to change the data of a town in the registry
+void registryUpdateTown(Registry *registry, Town *node, int districtId, int population, int elevation, int hasMunicipality) {
+    uint64_t started = monotonicNanoseconds();
+    beginChange(registry);
+
+    // Re-key the town in the population index when its population changes
+    if (node->population != population) {
+        adjustPopulationSums(registry->root, node->town, (long long)population - node->population);
+        registry->populationRoot = populationDelete(registry->populationRoot, node);
+        __atomic_store_n(&node->population, population, __ATOMIC_RELAXED); // Lock-free readers copy these fields
+        registry->populationRoot = populationInsert(registry->populationRoot, node);
+    }
+
+    // Move the town to its new district bitmap
+    if (node->districtId != districtId) {
+        ngramRemoveTown(&registry->ngrams, node); // Its postings name its row, which may change
+        bitmapRemoveTown(&registry->bitmaps, node);
+        __atomic_store_n(&node->districtId, districtId, __ATOMIC_RELAXED);
+        __atomic_store_n(&node->hasMunicipality, (unsigned char)hasMunicipality, __ATOMIC_RELAXED);
+        bitmapAddTown(&registry->bitmaps, node);
+        ngramAddTown(&registry->ngrams, node);
+        ngramCompact(&registry->ngrams, &registry->bitmaps);
+    }
+
+    __atomic_store_n(&node->elevation, elevation, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->hasMunicipality, (unsigned char)hasMunicipality, __ATOMIC_RELAXED);
+    bitmapSetMunicipality(&registry->bitmaps, node);
+    columnsStoreTown(&registry->columns, &registry->bitmaps, node);
+    endChange(registry);
+    markSegmentDirty(&registry->segments, node->town, 0);
+
+    if (registry->log != NULL)
+        appendLog(registry->log, LOG_UPDATE, node, node->town);
+    recordOperation(TIMER_UPDATE, started);
+}
+
+// Function to remove a town from the registry; returns 0 if it does not exist
+int registryDeleteTown(Registry *registry, char town[]) {
+    uint64_t started = monotonicNanoseconds();
+
+    // The hash probe finds the node; unlink it from every index before it is freed
+    beginChange(registry);
+    Town *node = deleteFromHashTable(registry->hashTable, town);
+    if (node == NULL) {
+        endChange(registry);
+        recordOperation(TIMER_DELETE, started);
+        return 0;
+    }
+    cacheForget(&registry->cache, node, hash(town));
+    registry->populationRoot = populationDelete(registry->populationRoot, node);
+    ngramRemoveTown(&registry->ngrams, node);
+    bitmapRemoveTown(&registry->bitmaps, node);
+    ngramCompact(&registry->ngrams, &registry->bitmaps);
+    if (registry->engine == ENGINE_BTREE)
+        btreeDelete(&registry->nameTree, town);
+    registry->root = deleteTown(registry->root, town);
+    endChange(registry);
+    markSegmentDirty(&registry->segments, town, -1);
+    if (registry->log != NULL)
+        appendLog(registry->log, LOG_DELETE, NULL, town);
+    recordOperation(TIMER_DELETE, started);
+    return 1;
+}
+
+// Function to look up a town by name for the thread holding the writer lock,
+// trying the lookup cache before the hash index
+Town* registryFindTown(Registry *registry, char town[]) {
+    uint64_t started = monotonicNanoseconds();
+    unsigned int hashValue = hash(town);
+    Town *node = cacheLookup(&registry->cache, town, hashValue);
+    if (node == NULL) {
+        HashTableEntry *entry = findHashEntry(registry->hashTable, town, hashValue, NULL);
+        if (entry != NULL) {
+            node = entry->townData;
+            cacheAdmit(&registry->cache, node, hashValue);
+        }
+    }
+    recordOperation(TIMER_FIND, started);
+    return node;
+}
+
+#define MULTIGET_CHUNK 256 // Names resolved per round of registryFindTowns
+
+// Function to look up many towns at once for the thread holding the writer
+// lock. Cached towns are answered directly and the rest go to the hash index
+// together, so their probes overlap. Returns the number of towns found.
+int registryFindTowns(Registry *registry, char *towns[], int count, Town *results[]) {
+    uint64_t started = monotonicNanoseconds();
+    int found = 0;
+    for (int base = 0; base < count; base += MULTIGET_CHUNK) {
+        int n = count - base < MULTIGET_CHUNK ? count - base : MULTIGET_CHUNK;
+        unsigned int hashValues[MULTIGET_CHUNK], missHashes[MULTIGET_CHUNK];
+        char *missNames[MULTIGET_CHUNK];
+        Town *missTowns[MULTIGET_CHUNK];
+        int missAt[MULTIGET_CHUNK], misses = 0;
+
+        for (int i = 0; i < n; i++) {
+            hashValues[i] = hash(towns[base + i]);
+            results[base + i] = cacheLookup(&registry->cache, towns[base + i], hashValues[i]);
+            if (results[base + i] == NULL) {
+                missNames[misses] = towns[base + i];
+                missHashes[misses] = hashValues[i];
+                missAt[misses++] = base + i;
+            }
+        }
+
+        multiGetHashTable(registry->hashTable, missNames, missHashes, misses, missTowns);
+        for (int i = 0; i < misses; i++) {
+            results[missAt[i]] = missTowns[i];
+            if (missTowns[i] != NULL)
+                cacheAdmit(&registry->cache, missTowns[i], missHashes[i]);
+        }
+        for (int i = 0; i < n; i++)
+            found += results[base + i] != NULL;
+    }
+    recordOperation(TIMER_MULTIGET, started);
+    return found;
+}
+
+// Function to count the towns whose names start with a prefix. Names with
+// the prefix sort from the prefix itself up to the prefix with its last byte
+// raised by one, so two rank descents count them however many there are.
+int countTownsWithPrefix(Town *root, const char prefix[]) {
+    char low[50], high[50];
+    int before, through;
+    long long population;
+    snprintf(low, sizeof(low), "%s", prefix);
+    strcpy(high, low);
+
+    int length = strlen(high);
+    while (length > 0 && (unsigned char)high[length - 1] == UCHAR_MAX)
+        high[--length] = '\0'; // Drop bytes that cannot be raised
+    if (length == 0)
+        return subtreeSize(root); // Every name starts with an empty prefix
+    high[length - 1]++;
+
+    countTownsBefore(root, low, 0, &before, &population);
+    countTownsBefore(root, high, 0, &through, &population);
+    return through - before;
+}
+
+// Function to list up to `limit` towns whose names start with a prefix, in
+// alphabetical order, from whichever ordered engine serves listings; returns
+// how many towns have the prefix in all
+int registryListPrefix(Registry *registry, char prefix[], int limit) {
+    size_t length = strlen(prefix);
+    if (registry->engine == ENGINE_BTREE) {
+        BTreeCursor cursor;
+        for (Town *node = btreeSeek(&registry->nameTree, &cursor, prefix); node != NULL && limit > 0 &&
+             strncmp(node->town, prefix, length) == 0; node = btreeNext(&cursor), limit--)
+            printTown(node);
+    } else {
+        TownCursor cursor;
+        cursorInit(&cursor, registry->root, ORDER_BY_NAME);
+        for (Town *node = cursorSeek(&cursor, prefix); node != NULL && limit > 0 &&
+             strncmp(node->town, prefix, length) == 0; node = cursorNext(&cursor), limit--)
+            printTown(node);
+    }
+    flushOutput(&output);
+    return countTownsWithPrefix(registry->root, prefix);
+}
+
+// Function to list the towns within maxEdits edits of a name, closest first; returns how many there are
+int registryListFuzzy(Registry *registry, char town[], int maxEdits, int limit) {
+    FuzzyMatch *matches;
+    int count = fuzzySearch(&registry->ngrams, &registry->bitmaps, town, maxEdits, &matches);
+    for (int i = 0; i < count && i < limit; i++)
+        printTown(matches[i].town);
+    flushOutput(&output);
+    free(matches);
+    return count;
+}
+
+// Function to build the population, bitmap, n-gram and B+-tree indexes over every town of a freshly loaded registry
+void buildSecondaryIndexes(Registry *registry) {
+    int count = 0;
+    Town **towns = (Town**)malloc((registry->hashTable->count + 1) * sizeof(Town*));
+    if (towns == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    collectTowns(registry->root, towns, &count);
+
+    // Rows are handed out in alphabetical order
+    reserveRows(&registry->bitmaps, count);
+    for (int i = 0; i < count; i++) {
+        bitmapAddTown(&registry->bitmaps, towns[i]);
+        ngramAddTown(&registry->ngrams, towns[i]);
+        columnsStoreTown(&registry->columns, &registry->bitmaps, towns[i]);
+    }
+    if (registry->engine == ENGINE_BTREE)
+        btreeBuild(&registry->nameTree, towns, count);
+
+    qsort(towns, count, sizeof(Town*), comparePopulationPointers);
+    registry->populationRoot = buildPopulationIndex(towns, count);
+    free(towns);
+}
+
+// Function to set up an empty registry ordered by the given engine, with no log
+void initRegistry(Registry *registry, int engine) {
+    registry->root = NULL; // Initialize the AVL tree
+    registry->engine = engine;
+    memset(&registry->nameTree, 0, sizeof(registry->nameTree));
+    memset(&registry->cache, 0, sizeof(registry->cache));
+    memset(&registry->segments, 0, sizeof(registry->segments));
+    memset(&registry->ngrams, 0, sizeof(registry->ngrams));
+    registry->populationRoot = NULL;
+    memset(&registry->bitmaps, 0, sizeof(registry->bitmaps));
+    memset(&registry->columns, 0, sizeof(registry->columns));
+    registry->hashTable = createHashTable(HASH_INITIAL_CAPACITY, HASH_MAX_LOAD_FACTOR); // Initialize the hash table
+    registry->log = NULL;
+    registry->generation = 0;
+    pthread_mutex_init(&registry->writeLock, NULL);
+    atomic_init(&registry->sequence, 0);
+    atomic_init(&registry->readRetries, 0);
+}
+
+// Function to release the indexes of a registry; its towns stay with the pool
+void freeRegistry(Registry *registry) {
+    freeColumnStore(&registry->columns);
+    freeBitmapIndex(&registry->bitmaps);
+    freeBTree(&registry->nameTree);
+    freeSegmentTable(&registry->segments);
+    freeNgramIndex(&registry->ngrams);
+    freeHashTable(registry->hashTable);
+    pthread_mutex_destroy(&registry->writeLock);
+}
+
+// Function to apply one logged change to the registry. Every record carries
+// the full new state of its town, so replaying a change twice is harmless.
+void applyLogRecord(Registry *registry, const LogRecord *record) {
+    char town[50], district[50];
+    memcpy(town, record->town, sizeof(town));
+    memcpy(district, record->district, sizeof(district));
+    district[sizeof(district) - 1] = '\0';
+
+    Town *node = findTown(registry->root, town);
+    if (record->op == LOG_DELETE) {
+        if (node != NULL)
+            registryDeleteTown(registry, town);
+        return;
+    }
+
+    int districtId = internDistrict(&districts, district);
+    int flag = record->hasMunicipality != 0;
+    if (node == NULL)
+        registryInsertTown(registry, districtId, town, record->population, record->elevation, flag);
+    else
+        registryUpdateTown(registry, node, districtId, record->population, record->elevation, flag);
+}
+
+// Function to fold the change log into a new snapshot and start an empty log
+int compactRegistry(Registry *registry) {
+    commitLog(registry->log);
+    if (!saveSnapshot(SNAPSHOT_FILE, registry->root, registry->generation + 1))
+        return 0;
+
+    // The new snapshot already holds every logged change, so a crash before
+    // the log is reset only leaves a log of the old generation to ignore
+    registry->generation++;
+    return resetLog(registry->log, registry->generation);
+}
+
+// Function to make the changes of one menu action or batch durable
+void commitRegistry(Registry *registry) {
+    commitLog(registry->log);
+
+    // Compact once the log outgrows the registry, keeping writes amortized O(1)
+    WriteAheadLog *log = registry->log;
+    if (log->records >= LOG_COMPACT_MIN_RECORDS && log->records > registry->hashTable->count)
+        compactRegistry(registry);
+}
+
+// Function to print the runtime counters, as a table or as one JSON object per call
+void printRuntimeStats(Registry *registry, int json) {
+    static const char *probeLabels[PROBE_BUCKETS] = { "1", "2", "3", "4", "5-8", "9-16", "17-32", "33-64", "65+" };
+    HashTable *table = registry->hashTable;
+    BitmapIndex *bitmaps = &registry->bitmaps;
+
+    // The shortest tree that can hold n towns has ceil(log2(n + 1)) levels
+    int towns = subtreeSize(registry->root), optimalHeight = 0;
+    while ((1LL << optimalHeight) - 1 < towns)
+        optimalHeight++;
+
+    long lookups = 0;
+    for (int i = 0; i < PROBE_BUCKETS; i++)
+        lookups += stats.probes[i];
+
+    int districtBitmaps = 0;
+    for (int i = 0; i < bitmaps->districtCount; i++)
+        districtBitmaps += bitmaps->districts[i] != NULL;
+    size_t slotBytes = ((size_t)table->capacity + table->oldCapacity) * sizeof(HashTableEntry);
+    size_t bitmapBytes = (size_t)bitmaps->capacity / 8 * (2 + districtBitmaps) +
+                         (size_t)bitmaps->capacity * (sizeof(Town*) + sizeof(int));
+    size_t columnBytes = (size_t)registry->columns.capacity * (3 * sizeof(int) + 1);
+    size_t btreeBytes = (size_t)registry->nameTree.nodes * BTREE_NODE_BYTES;
+    size_t ngramBytes = (size_t)(registry->ngrams.postings + registry->ngrams.stale) * sizeof(int) +
+                        (registry->ngrams.buckets != NULL ? NGRAM_BUCKETS * sizeof(PostingList) : 0);
+    const char *engine = registry->engine == ENGINE_BTREE ? "btree" : "avl";
+    LookupCache *cache = &registry->cache;
+    SegmentTable *segments = &registry->segments;
+    long cacheLookups = cache->hits + cache->misses;
+    struct rusage usage;
+    long peakResident = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+    if (json) {
+        printf("{\"towns\":%d,\"engine\":\"%s\",\"treeHeight\":%d,\"optimalHeight\":%d,\"btreeHeight\":%d",
+               towns, engine, height(registry->root), optimalHeight, registry->nameTree.height);
+        printf(",\"rotations\":{\"leftLeft\":%ld,\"rightRight\":%ld,\"leftRight\":%ld,\"rightLeft\":%ld}",
+               stats.rotations[ROTATE_LEFT_LEFT], stats.rotations[ROTATE_RIGHT_RIGHT],
+               stats.rotations[ROTATE_LEFT_RIGHT], stats.rotations[ROTATE_RIGHT_LEFT]);
+        printf(",\"hash\":{\"capacity\":%d,\"count\":%d,\"resizes\":%d,\"compactions\":%d,\"tombstones\":%d,\"probes\":{",
+               table->capacity, table->count, table->resizeCount, table->compactionCount, table->tombstones);
+        for (int i = 0; i < PROBE_BUCKETS; i++)
+            printf("%s\"%s\":%ld", i > 0 ? "," : "", probeLabels[i], stats.probes[i]);
+        printf("}},\"memory\":{\"townSlabs\":%zu,\"hashSlots\":%zu,\"bitmaps\":%zu,\"columns\":%zu,\"btreeNodes\":%zu,\"ngrams\":%zu,\"peakResidentKB\":%ld}",
+               townPool.bytesReserved, slotBytes, bitmapBytes, columnBytes, btreeBytes, ngramBytes, peakResident);
+        printf(",\"cache\":{\"hits\":%ld,\"misses\":%ld,\"admissions\":%ld,\"rejections\":%ld,\"invalidations\":%ld}",
+               cache->hits, cache->misses, cache->admissions, cache->rejections, cache->invalidations);
+        printf(",\"segments\":{\"count\":%d,\"pendingChanges\":%ld,\"lastSaveSegments\":%d,\"lastSaveTowns\":%ld}",
+               segments->count, segments->changes, segments->lastWritten, segments->lastTowns);
+        printf(",\"timers\":{");
+        for (int i = 0; i < TIMERS; i++) {
+            OperationTimer *t = &stats.timers[i];
+            printf("%s\"%s\":{\"count\":%ld,\"totalNs\":%llu,\"maxNs\":%llu,\"p50Ns\":%llu,\"p99Ns\":%llu}",
+                   i > 0 ? "," : "", timerNames[i], t->count, (unsigned long long)t->totalNanoseconds,
+                   (unsigned long long)t->maxNanoseconds, (unsigned long long)timerPercentile(t, 0.50),
+                   (unsigned long long)timerPercentile(t, 0.99));
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("Towns: %d, engine: %s, tree height: %d (optimal %d)\n", towns, engine, height(registry->root), optimalHeight);
+    if (registry->engine == ENGINE_BTREE)
+        printf("B+-tree: height %d, %ld nodes of %zu bytes\n", registry->nameTree.height, registry->nameTree.nodes, BTREE_NODE_BYTES);
+    printf("AVL rotations: left-left %ld, right-right %ld, left-right %ld, right-left %ld\n",
+           stats.rotations[ROTATE_LEFT_LEFT], stats.rotations[ROTATE_RIGHT_RIGHT],
+           stats.rotations[ROTATE_LEFT_RIGHT], stats.rotations[ROTATE_RIGHT_LEFT]);
+    printf("Hash table: %d towns in %d slots, %d resizes, %d compactions, %d tombstones\n",
+           table->count, table->capacity, table->resizeCount, table->compactionCount, table->tombstones);
+    printf("Probes per hash lookup (%ld lookups):\n", lookups);
+    for (int i = 0; i < PROBE_BUCKETS; i++)
+        printf("  %-6s %10ld  (%5.1f%%)\n", probeLabels[i], stats.probes[i], lookups > 0 ? 100.0 * stats.probes[i] / lookups : 0.0);
+    printf("Lookup cache: %ld hits, %ld misses (%.1f%% hit rate), %ld admitted, %ld rejected, %ld invalidated\n",
+           cache->hits, cache->misses, cacheLookups > 0 ? 100.0 * cache->hits / cacheLookups : 0.0,
+           cache->admissions, cache->rejections, cache->invalidations);
+    printf("Saved segments: %d, %ld changes since the last save, which wrote %d segments (%ld towns)\n",
+           segments->count, segments->changes, segments->lastWritten, segments->lastTowns);
+    printf("Memory: %zu bytes of town slabs, %zu of hash slots, %zu of bitmaps, %zu of columns, %zu of B+-tree nodes, "
+           "%zu of n-gram postings, peak resident %ld KB\n",
+           townPool.bytesReserved, slotBytes, bitmapBytes, columnBytes, btreeBytes, ngramBytes, peakResident);
+    printf("%-9s %10s %10s %10s %10s %10s\n", "operation", "count", "mean us", "p50 us", "p99 us", "max us");
+    for (int i = 0; i < TIMERS; i++) {
+        OperationTimer *t = &stats.timers[i];
+        if (t->count == 0)
+            continue;
+        printf("%-9s %10ld %10.2f %10.2f %10.2f %10.2f\n", timerNames[i], t->count, t->totalNanoseconds / 1e3 / t->count,
+               timerPercentile(t, 0.50) / 1e3, timerPercentile(t, 0.99) / 1e3, t->maxNanoseconds / 1e3);
+    }
+}
+
+// Function to insert a new record into the hash table
+void insertNewRecordIntoHashTable(Registry *registry) {
+    char town[50], district[50], hasMunicipality[4];
+    int population, elevation;
+
+    printf("Enter district: ");
+    scanf("%49s", district);
+    printf("Enter town: ");
+    scanf("%49s", town);
+    printf("Enter population: ");
+    scanf("%d", &population);
+    printf("Enter elevation: ");
+    scanf("%d", &elevation);
+    printf("Has municipality (yes/no): ");
+    scanf("%3s", hasMunicipality);
+    if (parseMunicipality(hasMunicipality) < 0) {
+        printf("Municipality must be yes or no.\n");
+        return;
+    }
 
-    // Update height of the current node
-    node->height = 1 + max(height(node->left), height(node->right));
+    // Insert the town into the AVL tree and the hash table
+    if (registryInsertTown(registry, internDistrict(&districts, district), town, population, elevation,
+                           parseMunicipality(hasMunicipality)) == NULL) {
+        printf("Town already exists.\n");
+        return;
+    }
 
-    // Get the balance factor to check if the node became unbalanced
-    int balance = getBalance(node);
+    printf("New record inserted successfully!\n");
+}
 
-    // Left Left Case
-    if (balance > 1 && strcmp(town, node->left->town) < 0)
-        return rightRotate(node);
+// Define the commands understood in batch mode
+#define BATCH_INSERT 0 // insert district town population elevation yes|no
+#define BATCH_UPDATE 1 // update town population elevation yes|no [district]
+#define BATCH_DELETE 2 // delete town
+#define BATCH_FIND 3   // find town
+#define BATCH_RANGE 4  // range minPopulation maxPopulation
+#define BATCH_STATS 5  // stats (prints the runtime counters as JSON)
+#define BATCH_MGET 6   // mget town [town ...]
+#define BATCH_PREFIX 7 // prefix text [limit] (lists up to limit towns starting with text, 10 by default)
+#define BATCH_FUZZY 8  // fuzzy town [edits] (lists towns within that many edits, 2 by default)
+#define BATCH_COMMANDS 9
+#define BATCH_MAX_NAMES 64 // Towns one mget line may ask for
+#define BATCH_MAX_LINE (BATCH_MAX_NAMES * 50 + 16) // Longest command line: an mget of full-length names
 
-    // Right Right Case
-    if (balance < -1 && strcmp(town, node->right->town) > 0)
-        return leftRotate(node);
+static const char *batchCommandNames[BATCH_COMMANDS] = { "insert", "update", "delete", "find", "range", "stats", "mget",
+                                                          "prefix", "fuzzy" };
 
-    // Left Right Case
-    if (balance > 1 && strcmp(town, node->left->town) > 0) {
-        node->left = leftRotate(node->left);
-        return rightRotate(node);
-    }
+// Define the latencies recorded for one kind of batch command
+typedef struct BatchTimings {
+    uint64_t *nanoseconds;
+    int count;
+    int capacity;
+    int failed; // Inserts of existing towns, and updates, deletes and finds of missing ones
+} BatchTimings;
 
-    // Right Left Case
-    if (balance < -1 && strcmp(town, node->right->town) < 0) {
-        node->right = rightRotate(node->right);
-        return leftRotate(node);
+// Function to record how long one command took
+void recordTiming(BatchTimings *timings, uint64_t nanoseconds) {
+    if (timings->count == timings->capacity) {
+        int capacity = timings->capacity ? timings->capacity * 2 : 1024;
+        uint64_t *grown = (uint64_t*)realloc(timings->nanoseconds, capacity * sizeof(uint64_t));
+        if (grown == NULL)
+            return; // Keep running, the summary just covers fewer commands
+        timings->nanoseconds = grown;
+        timings->capacity = capacity;
     }
+    timings->nanoseconds[timings->count++] = nanoseconds;
+}
 
-    return node; // Return the unchanged node pointer
+// Function to order latencies
+int compareNanoseconds(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
 }
 
-// Function to search for a town in the AVL tree
-Town* findTown(Town* root, char town[]) {
-    if (root == NULL || strcmp(root->town, town) == 0)
-        return root;
+// Function to print the latency percentiles of one kind of command
+void printTimings(const char *name, BatchTimings *timings) {
+    if (timings->count == 0)
+        return;
+    qsort(timings->nanoseconds, timings->count, sizeof(uint64_t), compareNanoseconds);
+    uint64_t total = 0;
+    for (int i = 0; i < timings->count; i++)
+        total += timings->nanoseconds[i];
+    fprintf(stderr, "%-7s %10d %8d %10.2f %10.2f %10.2f %10.2f\n", name, timings->count, timings->failed,
+            total / 1e3 / timings->count,
+            timings->nanoseconds[(int)(timings->count * 0.50)] / 1e3,
+            timings->nanoseconds[(int)(timings->count * 0.99)] / 1e3,
+            timings->nanoseconds[timings->count - 1] / 1e3);
+}
 
-    if (strcmp(root->town, town) < 0)
-        return findTown(root->right, town);
+// Function to run one batch command line, returning 1 if it succeeded, 0 if it
+// failed (e.g. the town was missing) and -1 if it could not be parsed
+int runBatchCommand(Registry *registry, int command, const char *arguments) {
+    char district[50], town[50], hasMunicipality[4];
+    int population, elevation, municipality;
 
-    return findTown(root->left, town);
+    switch (command) {
+        case BATCH_INSERT:
+            if (sscanf(arguments, "%49s %49s %d %d %3s", district, town, &population, &elevation, hasMunicipality) != 5 ||
+                (municipality = parseMunicipality(hasMunicipality)) < 0)
+                return -1;
+            return registryInsertTown(registry, internDistrict(&districts, district), town, population, elevation,
+                                      municipality) != NULL;
+        case BATCH_UPDATE: {
+            int fields = sscanf(arguments, "%49s %d %d %3s %49s", town, &population, &elevation, hasMunicipality, district);
+            if (fields < 4 || (municipality = parseMunicipality(hasMunicipality)) < 0)
+                return -1;
+            Town *node = registryFindTown(registry, town);
+            if (node == NULL)
+                return 0;
+            registryUpdateTown(registry, node, fields == 5 ? internDistrict(&districts, district) : node->districtId,
+                               population, elevation, municipality);
+            return 1;
+        }
+        case BATCH_DELETE:
+            if (sscanf(arguments, "%49s", town) != 1)
+                return -1;
+            return registryDeleteTown(registry, town);
+        case BATCH_FIND: {
+            if (sscanf(arguments, "%49s", town) != 1)
+                return -1;
+            Town *node = registryFindTown(registry, town);
+            if (node == NULL)
+                return 0;
+            printTown(node);
+            return 1;
+        }
+        case BATCH_RANGE: {
+            int minPopulation, maxPopulation;
+            if (sscanf(arguments, "%d %d", &minPopulation, &maxPopulation) != 2)
+                return -1;
+            listTownsInPopulationRange(registry->populationRoot, minPopulation, maxPopulation);
+            return 1;
+        }
+        case BATCH_STATS:
+            flushOutput(&output); // Keep the rows printed so far ahead of the counters
+            printRuntimeStats(registry, 1);
+            fflush(stdout);
+            return 1;
+        case BATCH_MGET: {
+            char names[BATCH_MAX_NAMES][50], *towns[BATCH_MAX_NAMES];
+            Town *results[BATCH_MAX_NAMES];
+            int count = 0, length;
+            while (count < BATCH_MAX_NAMES && sscanf(arguments, "%49s%n", names[count], &length) == 1) {
+                towns[count] = names[count];
+                arguments += length;
+                count++;
+            }
+            if (count == 0 || (count == BATCH_MAX_NAMES && sscanf(arguments, "%49s", town) == 1))
+                return -1; // No names, or more than one line may ask for
+            int found = registryFindTowns(registry, towns, count, results);
+            for (int i = 0; i < count; i++)
+                if (results[i] != NULL)
+                    printTown(results[i]);
+            return found == count;
+        }
+        case BATCH_PREFIX: {
+            int limit = 10;
+            if (sscanf(arguments, "%49s %d", town, &limit) < 1 || limit < 0)
+                return -1;
+            return registryListPrefix(registry, town, limit) > 0;
+        }
+        case BATCH_FUZZY: {
+            int maxEdits = 2;
+            if (sscanf(arguments, "%49s %d", town, &maxEdits) < 1 || maxEdits < 0 || maxEdits > FUZZY_MAX_EDITS)
+                return -1;
+            return registryListFuzzy(registry, town, maxEdits, INT_MAX) > 0;
+        }
+    }
+    return -1;
 }
 
-// Function to delete a town from the AVL tree
-Town* deleteTown(Town* root, char town[]) {
-    if (root == NULL) {
-        printf("Town not found.\n");
-        return root;
+// Function to execute a command stream from a file ("-" for stdin) without prompts.
+// Consecutive changes form one batch that is committed once, when a read command
+// follows, when the log's group is full or at the end of the stream. Results go to
+// stdout in the listing format; errors and the closing summary go to stderr.
+// Returns the number of lines that could not be parsed.
+int runBatch(Registry *registry, const char *path) {
+    FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (input == NULL) {
+        perror("Error opening batch file");
+        return 1;
     }
 
-    // Perform standard BST delete
-    if (strcmp(town, root->town) < 0)
-        root->left = deleteTown(root->left, town);
-    else if (strcmp(town, root->town) > 0)
-        root->right = deleteTown(root->right, town);
-    else {
-        // Node with only one child or no child
-        if ((root->left == NULL) || (root->right == NULL)) {
-            Town *temp = root->left ? root->left : root->right;
+    BatchTimings timings[BATCH_COMMANDS];
+    memset(timings, 0, sizeof(timings));
+    int malformed = 0, batches = 0, pendingChanges = 0, lineNumber = 0;
+    uint64_t commitTime = 0;
+    char line[BATCH_MAX_LINE];
 
-            // No child case
-            if (temp == NULL) {
-                temp = root;
-                root = NULL;
-            } else // One child case
-                *root = *temp; // Copy the contents of the non-empty child
+    uint64_t started = monotonicNanoseconds();
+    while (fgets(line, sizeof(line), input) != NULL) {
+        lineNumber++;
 
-            free(temp);
-        } else {
-            // Node with two children: Get the inorder successor (smallest in the right subtree)
-            Town *temp = root->right;
-            while (temp->left != NULL)
-                temp = temp->left;
+        // A line that does not fit is one malformed line: skip the rest of it
+        int c;
+        if (strchr(line, '\n') == NULL && (c = fgetc(input)) != EOF && c != '\n') {
+            while ((c = fgetc(input)) != EOF && c != '\n')
+                ;
+            fprintf(stderr, "Line %d: longer than %d characters\n", lineNumber, BATCH_MAX_LINE - 1);
+            malformed++;
+            continue;
+        }
 
-            // Copy the inorder successor's data to this node
-            strcpy(root->town, temp->town);
-            strcpy(root->district, temp->district);
-            root->population = temp->population;
-            root->elevation = temp->elevation;
-            strcpy(root->hasMunicipality, temp->hasMunicipality);
+        char name[16];
+        int consumed = 0;
+        if (sscanf(line, "%15s%n", name, &consumed) != 1 || name[0] == '#')
+            continue; // Blank line or comment
 
-            // Delete the inorder successor
-            root->right = deleteTown(root->right, temp->town);
+        int command = 0;
+        while (command < BATCH_COMMANDS && strcmp(name, batchCommandNames[command]) != 0)
+            command++;
+        if (command == BATCH_COMMANDS) {
+            fprintf(stderr, "Line %d: unknown command '%s'\n", lineNumber, name);
+            malformed++;
+            continue;
         }
-    }
-
-    // If the tree had only one node, return
-    if (root == NULL)
-        return root;
 
-    // Update height of the current node
-    root->height = 1 + max(height(root->left), height(root->right));
+        // A read ends the current batch, so it sees every earlier change on disk
+        int isChange = command <= BATCH_DELETE;
+        if (!isChange && pendingChanges > 0) {
+            uint64_t begin = monotonicNanoseconds();
+            commitRegistry(registry);
+            commitTime += monotonicNanoseconds() - begin;
+            batches++;
+            pendingChanges = 0;
+        }
 
-    // Get the balance factor to check if the node became unbalanced
-    int balance = getBalance(root);
+        uint64_t begin = monotonicNanoseconds();
+        int result = runBatchCommand(registry, command, line + consumed);
+        recordTiming(&timings[command], monotonicNanoseconds() - begin);
 
-    // Left Left Case
-    if (balance > 1 && getBalance(root->left) >= 0)
-        return rightRotate(root);
+        if (result < 0) {
+            fprintf(stderr, "Line %d: malformed %s command\n", lineNumber, name);
+            malformed++;
+        } else if (result == 0) {
+            timings[command].failed++;
+        }
 
-    // Left Right Case
-    if (balance > 1 && getBalance(root->left) < 0) {
-        root->left = leftRotate(root->left);
-        return rightRotate(root);
+        // The log writes a full group by itself, which closes the batch
+        if (isChange && ++pendingChanges == registry->log->groupSize) {
+            uint64_t begin = monotonicNanoseconds();
+            commitRegistry(registry);
+            commitTime += monotonicNanoseconds() - begin;
+            batches++;
+            pendingChanges = 0;
+        }
+    }
+    if (pendingChanges > 0) {
+        uint64_t begin = monotonicNanoseconds();
+        commitRegistry(registry);
+        commitTime += monotonicNanoseconds() - begin;
+        batches++;
     }
+    flushOutput(&output);
+    double elapsed = (monotonicNanoseconds() - started) / 1e9;
 
-    // Right Right Case
-    if (balance < -1 && getBalance(root->right) <= 0)
-        return leftRotate(root);
+    if (input != stdin)
+        fclose(input);
 
-    // Right Left Case
-    if (balance < -1 && getBalance(root->right) > 0) {
-        root->right = rightRotate(root->right);
-        return leftRotate(root);
+    // Summarize throughput and per-command latency
+    int total = 0;
+    for (int i = 0; i < BATCH_COMMANDS; i++)
+        total += timings[i].count;
+    fprintf(stderr, "%d commands in %.3f s (%.0f commands/s), %d batches committed in %.3f s, %d malformed lines\n",
+            total, elapsed, elapsed > 0 ? total / elapsed : 0.0, batches, commitTime / 1e9, malformed);
+    fprintf(stderr, "%-7s %10s %8s %10s %10s %10s %10s\n", "command", "count", "failed", "mean us", "p50 us", "p99 us", "max us");
+    for (int i = 0; i < BATCH_COMMANDS; i++) {
+        printTimings(batchCommandNames[i], &timings[i]);
+        free(timings[i].nanoseconds);
     }
+    return malformed;
+}
 
-    return root; // Return the balanced node
+// Define the state of one thread of the concurrent read benchmark
+typedef struct ReadBenchThread {
+    pthread_t thread;
+    Registry *registry;
+    char (*names)[50];  // Names of the towns registered when the benchmark started
+    int nameCount;
+    atomic_int *stop;   // Set by the main thread when the round is over
+    uint64_t seed;      // State of this thread's random generator
+    long operations;    // Lookups (readers) or changes (the writer) made
+    long misses;        // Lookups that did not find a registered town
+} ReadBenchThread;
+
+// Function to step a xorshift random generator
+static inline uint64_t nextRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
 }
 
-// Function to create a hash table
-HashTable* createHashTable() {
-    HashTable *table = (HashTable*)malloc(sizeof(HashTable));
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        table->entries[i] = NULL; // Initialize all entries to NULL
+// Function to look up random registered towns until the round is over
+void* readBenchReader(void *argument) {
+    ReadBenchThread *self = (ReadBenchThread*)argument;
+    Town copy;
+    while (!atomic_load_explicit(self->stop, memory_order_relaxed)) {
+        for (int i = 0; i < 64; i++) {
+            char *name = self->names[nextRandom(&self->seed) % self->nameCount];
+            if (!registryLookup(self->registry, name, &copy) || strcmp(copy.town, name) != 0)
+                self->misses++;
+        }
+        self->operations += 64;
     }
-    return table;
+    releaseReaderSlot();
+    return NULL;
 }
 
-// Hash function to compute the index for a town name
-unsigned int hash(char *town) {
-    unsigned long hashValue = 0;
-    for (int i = 0; i < 5 && town[i] != '\0'; i++) {
-        hashValue = hashValue * 31 + town[i]; // Use the first 5 characters for hashing
+// Function to keep changing the registry until the round is over: populations
+// are bumped and restored, and short-lived towns are inserted and deleted so the
+// hash index keeps resizing and compacting under the readers
+void* readBenchWriter(void *argument) {
+    ReadBenchThread *self = (ReadBenchThread*)argument;
+    Registry *registry = self->registry;
+    char town[50];
+    int inserted = 0, deleted = 0;
+
+    while (!atomic_load_explicit(self->stop, memory_order_relaxed)) {
+        registryLockWriter(registry);
+        Town *node = findTown(registry->root, self->names[nextRandom(&self->seed) % self->nameCount]);
+        int population = node->population;
+        registryUpdateTown(registry, node, node->districtId, population + 1, node->elevation, node->hasMunicipality);
+        registryUpdateTown(registry, node, node->districtId, population, node->elevation, node->hasMunicipality);
+
+        snprintf(town, sizeof(town), "~bench%d", inserted++);
+        registryInsertTown(registry, node->districtId, town, population, node->elevation, node->hasMunicipality);
+        if (inserted - deleted > 4096) {
+            snprintf(town, sizeof(town), "~bench%d", deleted++);
+            registryDeleteTown(registry, town);
+        }
+        registryUnlockWriter(registry);
+        self->operations += 4;
     }
-    return hashValue % TABLE_SIZE; // Modulo operation to fit within table size
+    return NULL;
 }
 
-// Function to insert a town into the hash table
-void insertIntoHashTable(HashTable *table, Town *townData) {
-    unsigned int index = hash(townData->town); // Compute the hash index
-    int originalIndex = index;
-
-    // Linear probing to handle collisions
-    while (table->entries[index] != NULL && table->entries[index]->isOccupied) {
-        index = (index + 1) % TABLE_SIZE;
-        if (index == originalIndex) {
-            printf("Hash table is full!\n");
-            return;
-        }
+// Function to measure lock-free lookup throughput with 1, 2, 4, ... reader
+// threads (up to the number of cores) running next to one busy writer
+void runReadBenchmark(Registry *source, double seconds) {
+    int count = source->hashTable->count;
+    if (count == 0) {
+        printf("No towns to look up.\n");
+        return;
     }
 
-    // Allocate memory for the new entry
-    HashTableEntry *entry = (HashTableEntry*)malloc(sizeof(HashTableEntry));
-    if (entry == NULL) {
+    // Readers draw from a private copy of the names, the writer owns the tree
+    char (*names)[50] = malloc((size_t)count * sizeof(*names));
+    Town **towns = (Town**)malloc((size_t)count * sizeof(Town*));
+    LoadedTown *loaded = (LoadedTown*)malloc((size_t)count * sizeof(LoadedTown));
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int maxReaders = cores > 1 ? cores : 1;
+    if (maxReaders > MAX_READERS)
+        maxReaders = MAX_READERS;
+    ReadBenchThread *threads = (ReadBenchThread*)calloc(maxReaders + 1, sizeof(ReadBenchThread));
+    if (names == NULL || towns == NULL || loaded == NULL || threads == NULL) {
         printf("Memory allocation failed!\n");
+        free(names);
+        free(towns);
+        free(loaded);
+        free(threads);
         return;
     }
 
-    // Insert data into the hash table
-    strcpy(entry->town, townData->town);
-    entry->townData = townData;
-    entry->isOccupied = 1; // Mark the slot as occupied
+    // Nothing the benchmark does is meant to be kept, so it runs on a private
+    // copy of the registry with no log, and the runtime counters are put back after
+    RuntimeStats saved = stats;
+    int collected = 0;
+    collectTowns(source->root, towns, &collected);
+    for (int i = 0; i < count; i++) {
+        strcpy(names[i], towns[i]->town);
+        loaded[i].town = newTown(towns[i]->districtId, towns[i]->town, towns[i]->population, towns[i]->elevation,
+                                 towns[i]->hasMunicipality);
+        loaded[i].order = i;
+    }
+    Registry copy;
+    Registry *registry = &copy;
+    initRegistry(registry, source->engine);
+    registry->root = bulkBuildSorted(loaded, count, registry->hashTable);
+    buildSecondaryIndexes(registry);
+    free(loaded);
 
-    table->entries[index] = entry; // Add the entry to the hash table
-}
+    printf("Read benchmark: %d towns, %d cores, %.1f s per round\n", count, cores, seconds);
+    printf("%7s %14s %14s %10s %14s\n", "readers", "lookups/s", "per reader", "retries", "writer ops/s");
+    for (int readers = 1; ; readers = readers * 2 < maxReaders ? readers * 2 : maxReaders) {
+        atomic_int stop = 0;
+        long retriesBefore = atomic_load(&registry->readRetries);
+        for (int i = 0; i <= readers; i++) {
+            threads[i] = (ReadBenchThread){ 0 };
+            threads[i].registry = registry;
+            threads[i].names = names;
+            threads[i].nameCount = count;
+            threads[i].stop = &stop;
+            threads[i].seed = mix64(hashSeed + i + 1) | 1;
+            pthread_create(&threads[i].thread, NULL, i == 0 ? readBenchWriter : readBenchReader, &threads[i]);
+        }
 
-// Function to delete a town from the hash table
-void deleteFromHashTable(HashTable *table, char *town) {
-    unsigned int index = hash(town); // Compute the hash index
-    int originalIndex = index;
+        uint64_t started = monotonicNanoseconds();
+        struct timespec pause = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+        nanosleep(&pause, NULL);
+        atomic_store(&stop, 1);
+        for (int i = 0; i <= readers; i++)
+            pthread_join(threads[i].thread, NULL);
+        double elapsed = (monotonicNanoseconds() - started) / 1e9;
 
-    // Linear probing to find the town
-    while (table->entries[index] != NULL) {
-        if (table->entries[index]->isOccupied && strcmp(table->entries[index]->town, town) == 0) {
-            // Free the memory allocated for the entry
-            free(table->entries[index]);
-            table->entries[index] = NULL; // Mark the slot as unoccupied
-            printf("Town deleted successfully!\n");
-            return;
-        }
-        index = (index + 1) % TABLE_SIZE;
-        if (index == originalIndex) {
-            break; // Entire table has been searched
+        long lookups = 0, misses = 0;
+        for (int i = 1; i <= readers; i++) {
+            lookups += threads[i].operations;
+            misses += threads[i].misses;
         }
+        printf("%7d %14.0f %14.0f %10ld %14.0f\n", readers, lookups / elapsed, lookups / elapsed / readers,
+               atomic_load(&registry->readRetries) - retriesBefore, threads[0].operations / elapsed);
+        if (misses > 0)
+            printf("%ld lookups missed a registered town!\n", misses);
+        if (readers == maxReaders)
+            break;
     }
 
-    printf("Town not found.\n");
+    // Give the copied towns, and those the writer left behind, back to the pool
+    towns = (Town**)realloc(towns, ((size_t)registry->hashTable->count + 1) * sizeof(Town*));
+    if (towns == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    collected = 0;
+    collectTowns(registry->root, towns, &collected);
+    for (int i = 0; i < collected; i++)
+        freeTown(towns[i]);
+    freeRegistry(registry);
+    stats = saved;
+    free(towns);
+    free(threads);
+    free(names);
 }
 
-// Function to print towns in alphabetical order (in-order traversal of AVL tree)
-void inOrder(Town* root) {
-    if (root != NULL) {
-        inOrder(root->left);
-        printf("Town: %s, District: %s, Population: %d, Elevation: %d, Municipality: %s\n",
-               root->town, root->district, root->population, root->elevation, root->hasMunicipality);
-        inOrder(root->right);
-    }
+// Define the settings of the synthetic benchmark
+typedef struct BenchConfig {
+    int size;        // Towns loaded first, and operations in the mixed phase that follows
+    int readPercent; // Share of lookups in the mixed phase; the rest are inserts and deletes
+    int prefix;      // Length of the prefix every generated name shares, to stress hash()
+} BenchConfig;
+
+// Define the operations timed by the benchmark
+#define BENCH_INSERT 0      // insert
+#define BENCH_HASH_INSERT 1 // insertIntoHashTable
+#define BENCH_FIND 2        // findTown
+#define BENCH_HASH_FIND 3   // The probe behind searchTownInHashTable
+#define BENCH_DELETE 4      // deleteTown
+#define BENCH_HASH_DELETE 5 // deleteFromHashTable
+#define BENCH_OPERATIONS 6
+#define BENCH_MAX_PREFIX 40 // Leaves room for a 7-letter suffix in a 50-byte name
+
+static const char *benchOperationNames[BENCH_OPERATIONS] = {
+    "insert", "hash insert", "find", "hash find", "delete", "hash delete"
+};
+
+// Function to write the name of synthetic town `id`: the shared prefix, then
+// the id in base 26 with its lowest digit first, so names sort in no useful order
+void benchTownName(char name[50], int id, int prefix) {
+    static const char filler[] = "KhirbetBeitDeirKafrAbuArabAlQudsNablusJeninTubas";
+    memcpy(name, filler, prefix);
+    char *p = name + prefix;
+    do {
+        *p++ = (char)('a' + id % 26);
+        id /= 26;
+    } while (id > 0);
+    *p = '\0';
 }
 
-// Function to list towns with a population greater than a given number
-void listTownsByPopulation(Town* root, int population) {
-    if (root != NULL) {
-        listTownsByPopulation(root->left, population);
-        if (root->population > population) {
-            printf("Town: %s, District: %s, Population: %d, Elevation: %d, Municipality: %s\n",
-                   root->town, root->district, root->population, root->elevation, root->hasMunicipality);
-        }
-        listTownsByPopulation(root->right, population);
-    }
+// Function to add a town to a benchmark tree and hash table, timing both steps
+Town* benchInsert(Town *root, HashTable *table, char town[], int districtId, BatchTimings *timings) {
+    Town *node;
+    uint64_t begin = monotonicNanoseconds();
+    root = insert(root, districtId, town, 1000, 100, 1, &node);
+    recordTiming(&timings[BENCH_INSERT], monotonicNanoseconds() - begin);
+
+    begin = monotonicNanoseconds();
+    insertIntoHashTable(table, node);
+    recordTiming(&timings[BENCH_HASH_INSERT], monotonicNanoseconds() - begin);
+    return root;
 }
 
-// Function to list towns based on municipality status
-void listTownsByMunicipality(Town* root, char hasMunicipality[]) {
-    if (root != NULL) {
-        listTownsByMunicipality(root->left, hasMunicipality);
-        if (strcmp(root->hasMunicipality, hasMunicipality) == 0) {
-            printf("Town: %s, District: %s, Population: %d, Elevation: %d, Municipality: %s\n",
-                   root->town, root->district, root->population, root->elevation, root->hasMunicipality);
-        }
-        listTownsByMunicipality(root->right, hasMunicipality);
-    }
+// Function to print the throughput and latency of one benchmarked operation
+void printBenchTimings(const char *name, BatchTimings *timings) {
+    if (timings->count == 0)
+        return;
+    qsort(timings->nanoseconds, timings->count, sizeof(uint64_t), compareNanoseconds);
+    uint64_t total = 0;
+    for (int i = 0; i < timings->count; i++)
+        total += timings->nanoseconds[i];
+    printf("%-12s %10d %14.0f %10.3f %10.3f %10.3f\n", name, timings->count,
+           total > 0 ? timings->count / (total / 1e9) : 0.0, total / 1e3 / timings->count,
+           timings->nanoseconds[(int)(timings->count * 0.50)] / 1e3,
+           timings->nanoseconds[(int)(timings->count * 0.99)] / 1e3);
 }
 
-// Function to save the AVL tree data to a file
-void saveToFile(Town* root, FILE *file) {
-    if (root != NULL) {
-        saveToFile(root->left, file); // Traverse the left subtree
-        fprintf(file, "%s:%s:%d:%d:%s\n", root->district, root->town, root->population, root->elevation, root->hasMunicipality); // Write data to file
-        saveToFile(root->right, file); // Traverse the right subtree
+#define BENCH_MULTIGET_NAMES 64 // Names per multiGetHashTable call in the benchmark
+
+// Function to compare looking towns up in the hash table one by one with
+// multiGetHashTable, over the same towns in the same random order
+void benchMultiGet(HashTable *table, char (*names)[50], int *live, int liveCount) {
+    char *towns[BENCH_MULTIGET_NAMES];
+    unsigned int hashValues[BENCH_MULTIGET_NAMES];
+    Town *results[BENCH_MULTIGET_NAMES];
+    int missed = 0;
+
+    uint64_t begin = monotonicNanoseconds();
+    for (int i = 0; i < liveCount; i++) {
+        char *town = names[live[i]];
+        if (findHashEntry(table, town, hash(town), NULL) == NULL)
+            missed++;
     }
-}
+    double singleSeconds = (monotonicNanoseconds() - begin) / 1e9;
 
-// Function to print the hash table
-void printHashedTable(HashTable *table) {
-    printf("Hashed Table:\n");
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        printf("Index %d: ", i);
-        HashTableEntry *entry = table->entries[i];
-        if (entry == NULL) {
-            printf("Empty\n");
-        } else {
-            printf("%s -> ", entry->town);
-            printf("NULL\n");
+    begin = monotonicNanoseconds();
+    for (int base = 0; base < liveCount; base += BENCH_MULTIGET_NAMES) {
+        int n = liveCount - base < BENCH_MULTIGET_NAMES ? liveCount - base : BENCH_MULTIGET_NAMES;
+        for (int i = 0; i < n; i++) {
+            towns[i] = names[live[base + i]];
+            hashValues[i] = hash(towns[i]);
         }
+        multiGetHashTable(table, towns, hashValues, n, results);
+        for (int i = 0; i < n; i++)
+            missed += results[i] == NULL;
     }
+    double multiSeconds = (monotonicNanoseconds() - begin) / 1e9;
+
+    printf("Hash lookups of %d towns: %.0f towns/s one by one, %.0f towns/s through multi-get\n", liveCount,
+           singleSeconds > 0 ? liveCount / singleSeconds : 0.0, multiSeconds > 0 ? liveCount / multiSeconds : 0.0);
+    if (missed > 0)
+        printf("%d hash lookups missed a town!\n", missed);
 }
 
-// Function to print hash table statistics
-void printHashTableStats(HashTable *table) {
-    int count = 0;
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        if (table->entries[i] != NULL && table->entries[i]->isOccupied) {
-            count++;
-        }
+// Define the operations timed when the benchmark compares the ordered engines
+#define ENGINE_FIND 0         // findTown
+#define ENGINE_BTREE_FIND 1   // btreeFind
+#define ENGINE_RANGE 2        // cursorSeek, then BENCH_RANGE_LENGTH steps of cursorNext
+#define ENGINE_BTREE_RANGE 3  // btreeSeek, then BENCH_RANGE_LENGTH steps of btreeNext
+#define ENGINE_BTREE_INSERT 4 // btreeInsert
+#define ENGINE_BTREE_DELETE 5 // btreeDelete
+#define ENGINE_OPERATIONS 6
+#define BENCH_RANGE_LENGTH 100 // Towns visited by each range scan
+#define BENCH_SCAN_ROUNDS 5    // Full scans per engine; the fastest one is reported
+
+static const char *engineOperationNames[ENGINE_OPERATIONS] = {
+    "avl find", "btree find", "avl range", "btree range", "btree insert", "btree delete"
+};
+
+// Function to compare the AVL tree with the B+-tree on the towns left after
+// the mixed phase: the B+-tree is built by inserts in random order, then both
+// engines answer the same lookups, full scans and range scans, and the
+// B+-tree is emptied again by deletes
+void benchEngines(Town *root, char (*names)[50], int nameCount, int *live, int liveCount, uint64_t *seed) {
+    BatchTimings timings[ENGINE_OPERATIONS];
+    memset(timings, 0, sizeof(timings));
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+
+    for (int i = 0; i < liveCount; i++) {
+        Town *node = findTown(root, names[live[i]]);
+        uint64_t begin = monotonicNanoseconds();
+        int added = btreeInsert(&tree, node);
+        recordTiming(&timings[ENGINE_BTREE_INSERT], monotonicNanoseconds() - begin);
+        if (!added)
+            timings[ENGINE_BTREE_INSERT].failed++;
     }
-    printf("Size of hash table: %d\n", TABLE_SIZE);
-    printf("Load factor: %.2f\n", (float)count / TABLE_SIZE);
-}
 
-// Function to search for a town in the hash table and print the number of collisions
-void searchTownInHashTable(HashTable *table, char *town) {
-    unsigned int index = hash(town);
-    int collisions = 0;
+    // Both engines look up the same towns; they must find the same nodes
+    for (int i = 0; i < liveCount; i++) {
+        char *town = names[live[nextRandom(seed) % liveCount]];
+        uint64_t begin = monotonicNanoseconds();
+        Town *found = findTown(root, town);
+        recordTiming(&timings[ENGINE_FIND], monotonicNanoseconds() - begin);
+        begin = monotonicNanoseconds();
+        Town *btreeFound = btreeFind(&tree, town);
+        recordTiming(&timings[ENGINE_BTREE_FIND], monotonicNanoseconds() - begin);
+        if (found == NULL)
+            timings[ENGINE_FIND].failed++;
+        if (btreeFound != found)
+            timings[ENGINE_BTREE_FIND].failed++;
+    }
 
-    // Linear probing to find the town
-    while (table->entries[index] != NULL) {
-        if (table->entries[index]->isOccupied && strcmp(table->entries[index]->town, town) == 0) {
-            printf("Town found: %s\n", table->entries[index]->town);
-            printf("Number of collisions: %d\n", collisions);
-            return;
-        }
-        collisions++;
-        index = (index + 1) % TABLE_SIZE;
+    // Range scans start from any generated name, loaded or not
+    int rangeScans = liveCount < 10000 ? liveCount : 10000;
+    for (int i = 0; i < rangeScans; i++) {
+        char *town = names[nextRandom(seed) % nameCount];
+        uintptr_t visited = 0, btreeVisited = 0;
+        TownCursor cursor;
+        BTreeCursor btreeCursor;
+
+        uint64_t begin = monotonicNanoseconds();
+        cursorInit(&cursor, root, ORDER_BY_NAME);
+        Town *node = cursorSeek(&cursor, town);
+        for (int j = 0; node != NULL && j < BENCH_RANGE_LENGTH; j++, node = cursorNext(&cursor))
+            visited = visited * 31 + (uintptr_t)node;
+        recordTiming(&timings[ENGINE_RANGE], monotonicNanoseconds() - begin);
+
+        begin = monotonicNanoseconds();
+        node = btreeSeek(&tree, &btreeCursor, town);
+        for (int j = 0; node != NULL && j < BENCH_RANGE_LENGTH; j++, node = btreeNext(&btreeCursor))
+            btreeVisited = btreeVisited * 31 + (uintptr_t)node;
+        recordTiming(&timings[ENGINE_BTREE_RANGE], monotonicNanoseconds() - begin);
+        if (visited != btreeVisited)
+            timings[ENGINE_BTREE_RANGE].failed++;
     }
 
-    printf("Town not found.\n");
-}
+    // Full scans in name order, summing populations so the walk cannot be skipped
+    double scanSeconds = 0, btreeScanSeconds = 0;
+    long long population = 0, btreePopulation = 0;
+    for (int round = 0; round < BENCH_SCAN_ROUNDS; round++) {
+        TownCursor cursor;
+        BTreeCursor btreeCursor;
+        population = btreePopulation = 0;
 
-// Function to insert a new record into the hash table
-void insertNewRecordIntoHashTable(HashTable *table, Town *root) {
-    char town[50], district[50], hasMunicipality[4];
-    int population, elevation;
+        uint64_t begin = monotonicNanoseconds();
+        cursorInit(&cursor, root, ORDER_BY_NAME);
+        for (Town *node = cursorFirst(&cursor); node != NULL; node = cursorNext(&cursor))
+            population += node->population;
+        double seconds = (monotonicNanoseconds() - begin) / 1e9;
+        if (round == 0 || seconds < scanSeconds)
+            scanSeconds = seconds;
 
-    printf("Enter district: ");
-    scanf("%s", district);
-    printf("Enter town: ");
-    scanf("%s", town);
-    printf("Enter population: ");
-    scanf("%d", &population);
-    printf("Enter elevation: ");
-    scanf("%d", &elevation);
-    printf("Has municipality (yes/no): ");
-    scanf("%s", hasMunicipality);
+        begin = monotonicNanoseconds();
+        for (Town *node = btreeSeek(&tree, &btreeCursor, NULL); node != NULL; node = btreeNext(&btreeCursor))
+            btreePopulation += node->population;
+        seconds = (monotonicNanoseconds() - begin) / 1e9;
+        if (round == 0 || seconds < btreeScanSeconds)
+            btreeScanSeconds = seconds;
+    }
 
-    // Insert the town into the AVL tree
-    root = insert(root, district, town, population, elevation, hasMunicipality);
+    printf("Engines: %d towns, B+-tree height %d with %ld nodes of %zu bytes (%zu bytes), AVL height %d\n",
+           liveCount, tree.height, tree.nodes, BTREE_NODE_BYTES, (size_t)tree.nodes * BTREE_NODE_BYTES, height(root));
+    printf("Full scan: avl %.0f towns/s, btree %.0f towns/s\n",
+           scanSeconds > 0 ? liveCount / scanSeconds : 0.0, btreeScanSeconds > 0 ? liveCount / btreeScanSeconds : 0.0);
+    if (population != btreePopulation)
+        printf("The engines scanned different towns!\n");
 
-    // Insert the town into the hash table
-    insertIntoHashTable(table, findTown(root, town));
+    for (int i = 0; i < liveCount; i++) {
+        int k = nextRandom(seed) % (liveCount - i) + i; // Delete in a fresh random order
+        int swap = live[i];
+        live[i] = live[k];
+        live[k] = swap;
+        uint64_t begin = monotonicNanoseconds();
+        Town *removed = btreeDelete(&tree, names[live[i]]);
+        recordTiming(&timings[ENGINE_BTREE_DELETE], monotonicNanoseconds() - begin);
+        if (removed == NULL)
+            timings[ENGINE_BTREE_DELETE].failed++;
+    }
+    if (tree.root != NULL || tree.nodes != 0)
+        printf("The B+-tree kept %ld nodes after every town was deleted!\n", tree.nodes);
 
-    printf("New record inserted successfully!\n");
+    printf("%-12s %10s %14s %10s %10s %10s\n", "operation", "count", "ops/s", "mean us", "p50 us", "p99 us");
+    for (int i = 0; i < ENGINE_OPERATIONS; i++) {
+        printBenchTimings(engineOperationNames[i], &timings[i]);
+        if (timings[i].failed > 0)
+            printf("%d %s operations disagreed with the AVL tree!\n", timings[i].failed, engineOperationNames[i]);
+        free(timings[i].nanoseconds);
+    }
+    freeBTree(&tree);
 }
 
-// Function to update the towns.txt file after deletion
-void updateFileAfterDeletion(Town *root, char *town) {
-    FILE *file = fopen("towns.txt", "w");
-    if (file == NULL) {
-        printf("Error opening file!\n");
+// Function to measure the AVL tree and hash table on synthetic towns: `size`
+// towns are loaded in random order, then `size` operations mix lookups with
+// inserts of new towns and deletes of loaded ones, and the towns left are used
+// to compare the AVL tree with the B+-tree. The registry is not touched.
+void runBenchmark(BenchConfig *config) {
+    int size = config->size;
+    int prefix = config->prefix < BENCH_MAX_PREFIX ? config->prefix : BENCH_MAX_PREFIX;
+    int capacity = 2 * size; // The mixed phase adds at most `size` new towns
+
+    char (*names)[50] = malloc((size_t)capacity * sizeof(*names));
+    int *live = (int*)malloc((size_t)capacity * sizeof(int)); // Ids of the towns in the tree
+    if (names == NULL || live == NULL) {
+        printf("Memory allocation failed!\n");
+        free(names);
+        free(live);
         return;
     }
+    for (int i = 0; i < capacity; i++)
+        benchTownName(names[i], i, prefix);
 
-    // Helper function to write updated data to the file
-    void writeToFile(Town *root) {
-        if (root != NULL) {
-            writeToFile(root->left);
-            if (strcmp(root->town, town) != 0) { // Skip the deleted town
-                fprintf(file, "%s:%s:%d:%d:%s\n", root->district, root->town, root->population, root->elevation, root->hasMunicipality);
-            }
-            writeToFile(root->right);
+    // Load the first half of the names in random order
+    uint64_t seed = mix64(hashSeed) | 1;
+    for (int i = 0; i < size; i++)
+        live[i] = i;
+    for (int i = size - 1; i > 0; i--) {
+        int j = nextRandom(&seed) % (i + 1);
+        int swap = live[i];
+        live[i] = live[j];
+        live[j] = swap;
+    }
+
+    Town *root = NULL;
+    HashTable *table = createHashTable(HASH_INITIAL_CAPACITY, HASH_MAX_LOAD_FACTOR);
+    int districtId = internDistrict(&districts, "Benchmark");
+    BatchTimings timings[BENCH_OPERATIONS];
+    memset(timings, 0, sizeof(timings));
+
+    long rotationsBefore = countRotations();
+    uint64_t started = monotonicNanoseconds();
+    for (int i = 0; i < size; i++)
+        root = benchInsert(root, table, names[live[i]], districtId, timings);
+    double loadSeconds = (monotonicNanoseconds() - started) / 1e9;
+    long loadRotations = countRotations() - rotationsBefore;
+
+    // Mix lookups of loaded towns with inserts of new ones and deletes
+    int liveCount = size, nextId = size, inserts = 0;
+    long lookups = 0, probes = 0, mixedRotations = 0;
+    started = monotonicNanoseconds();
+    for (int i = 0; i < size; i++) {
+        int roll = nextRandom(&seed) % 100;
+        if (roll < config->readPercent && liveCount > 0) {
+            char *town = names[live[nextRandom(&seed) % liveCount]];
+            uint64_t begin = monotonicNanoseconds();
+            Town *found = findTown(root, town);
+            recordTiming(&timings[BENCH_FIND], monotonicNanoseconds() - begin);
+            if (found == NULL)
+                timings[BENCH_FIND].failed++;
+
+            int collisions = 0;
+            begin = monotonicNanoseconds();
+            HashTableEntry *entry = findHashEntry(table, town, hash(town), &collisions);
+            recordTiming(&timings[BENCH_HASH_FIND], monotonicNanoseconds() - begin);
+            if (entry == NULL || entry->townData != found)
+                timings[BENCH_HASH_FIND].failed++;
+            probes += collisions + 1;
+            lookups++;
+        } else if ((nextRandom(&seed) & 1) || liveCount == 0) {
+            rotationsBefore = countRotations();
+            root = benchInsert(root, table, names[nextId], districtId, timings);
+            mixedRotations += countRotations() - rotationsBefore;
+            live[liveCount++] = nextId++;
+            inserts++;
+        } else {
+            int k = nextRandom(&seed) % liveCount;
+            char *town = names[live[k]];
+            live[k] = live[--liveCount];
+
+            uint64_t begin = monotonicNanoseconds();
+            deleteFromHashTable(table, town);
+            recordTiming(&timings[BENCH_HASH_DELETE], monotonicNanoseconds() - begin);
+            begin = monotonicNanoseconds();
+            root = deleteTown(root, town);
+            recordTiming(&timings[BENCH_DELETE], monotonicNanoseconds() - begin);
         }
     }
+    double mixedSeconds = (monotonicNanoseconds() - started) / 1e9;
+
+    printf("Benchmark: %d towns, %d%% reads, %d-character shared prefix\n", size, config->readPercent, prefix);
+    printf("Load:  %d inserts in %.3f s (%.0f towns/s), %.2f rotations per insert\n", size, loadSeconds,
+           loadSeconds > 0 ? size / loadSeconds : 0.0, (double)loadRotations / size);
+    printf("Mixed: %d operations in %.3f s (%.0f ops/s), %.2f rotations per insert\n", size, mixedSeconds,
+           mixedSeconds > 0 ? size / mixedSeconds : 0.0, inserts > 0 ? (double)mixedRotations / inserts : 0.0);
+    printf("%-12s %10s %14s %10s %10s %10s\n", "operation", "count", "ops/s", "mean us", "p50 us", "p99 us");
+    for (int i = 0; i < BENCH_OPERATIONS; i++) {
+        printBenchTimings(benchOperationNames[i], &timings[i]);
+        if (timings[i].failed > 0)
+            printf("%d %s operations missed a town!\n", timings[i].failed, benchOperationNames[i]);
+        free(timings[i].nanoseconds);
+    }
+    if (lookups > 0)
+        printf("Average probe length: %.2f over %ld lookups (load factor %.2f)\n", (double)probes / lookups, lookups,
+               (double)table->count / table->capacity);
+    benchMultiGet(table, names, live, liveCount);
+    printf("Tree height: %d for %d towns\n", height(root), subtreeSize(root));
 
-    writeToFile(root); // Write updated data to the file
-    fclose(file);
-    printf("File updated successfully!\n");
+    struct rusage usage;
+    printf("Memory: %zu bytes of town slabs, %zu bytes of hash slots",
+           townPool.bytesReserved, ((size_t)table->capacity + table->oldCapacity) * sizeof(HashTableEntry));
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        printf(", peak resident %ld KB", usage.ru_maxrss);
+    printf("\n");
+    benchEngines(root, names, nextId, live, liveCount, &seed);
+
+    // Give every benchmark town back to the pool
+    Town **towns = (Town**)malloc(((size_t)liveCount + 1) * sizeof(Town*));
+    if (towns != NULL) {
+        int count = 0;
+        collectTowns(root, towns, &count);
+        for (int i = 0; i < count; i++)
+            freeTown(towns[i]);
+        free(towns);
+    }
+    freeHashTable(table);
+    free(live);
+    free(names);
+}
+
+// Function to print how to start the program
+void printUsage(const char *program) {
+    printf("Usage: %s [--fsync=always|group|none] [--group-size=N] [--format=text|colon|csv|json] [--batch=FILE|-] [--read-bench[=SECONDS]] [--load-threads=N]\n"
+           "       [--engine=avl|btree] [--bench[=SIZE]] [--bench-reads=PERCENT] [--bench-prefix=LENGTH]\n", program);
 }
 
 // Main function
-int main() {
-    FILE *file = fopen("districts.txt", "r");
-    if (file == NULL) {
-        printf("File not found. Creating a new file...\n");
-        file = fopen("districts.txt", "w");
-        if (file == NULL) {
-            perror("Error creating file");
+int main(int argc, char *argv[]) {
+    int syncPolicy = LOG_SYNC_GROUP; // How appended changes reach the disk
+    int groupSize = LOG_GROUP_SIZE;  // Changes per group commit
+    const char *batchPath = NULL;    // Command stream to run instead of the menu
+    double benchSeconds = 0;         // Length of each read benchmark round, 0 to run the menu
+    int loadThreads = (int)sysconf(_SC_NPROCESSORS_ONLN); // Threads that parse districts.txt
+    BenchConfig bench = { 0, 90, 0 }; // Synthetic benchmark to run, none while size is 0
+    int engine = ENGINE_AVL;          // Index serving name lookups and alphabetical listings
+
+    // Parse the command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fsync=always") == 0) {
+            syncPolicy = LOG_SYNC_ALWAYS;
+        } else if (strcmp(argv[i], "--fsync=group") == 0) {
+            syncPolicy = LOG_SYNC_GROUP;
+        } else if (strcmp(argv[i], "--fsync=none") == 0) {
+            syncPolicy = LOG_SYNC_NONE;
+        } else if (strncmp(argv[i], "--group-size=", 13) == 0 && atoi(argv[i] + 13) > 0) {
+            groupSize = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--format=", 9) == 0 && parseOutputFormat(argv[i] + 9) >= 0) {
+            output.format = parseOutputFormat(argv[i] + 9); // Format of the menu listings
+        } else if (strncmp(argv[i], "--batch=", 8) == 0 && argv[i][8] != '\0') {
+            batchPath = argv[i] + 8;
+        } else if (strcmp(argv[i], "--read-bench") == 0) {
+            benchSeconds = 1;
+        } else if (strncmp(argv[i], "--read-bench=", 13) == 0 && atof(argv[i] + 13) > 0) {
+            benchSeconds = atof(argv[i] + 13);
+        } else if (strncmp(argv[i], "--load-threads=", 15) == 0 && atoi(argv[i] + 15) > 0) {
+            loadThreads = atoi(argv[i] + 15);
+        } else if (strcmp(argv[i], "--engine=avl") == 0) {
+            engine = ENGINE_AVL;
+        } else if (strcmp(argv[i], "--engine=btree") == 0) {
+            engine = ENGINE_BTREE;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench.size = 100000;
+        } else if (strncmp(argv[i], "--bench=", 8) == 0 && atoi(argv[i] + 8) > 0) {
+            bench.size = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--bench-reads=", 14) == 0 && atoi(argv[i] + 14) >= 0 && atoi(argv[i] + 14) <= 100) {
+            bench.readPercent = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--bench-prefix=", 15) == 0 && atoi(argv[i] + 15) >= 0) {
+            bench.prefix = atoi(argv[i] + 15);
+        } else {
+            printUsage(argv[0]);
             return 1;
         }
-        // Add sample data to the file
-        fprintf(file, "AlQuds:Hezma:5000:550:yes\n");
-        fprintf(file, "Nablus:Asira:8000:350:yes\n");
-        fprintf(file, "AlQuds:Qatanna:3000:300:No\n");
-        fprintf(file, "Jenin:Yabad:12000:200:yes\n");
-        fclose(file);
-        file = fopen("districts.txt", "r");
     }
 
-    Town *root = NULL; // Initialize the AVL tree
-    HashTable *hashTable = createHashTable(); // Initialize the hash table
+    initHashSeed(); // Seed the town-name hash before any table is built
+
+    Registry registry;
+    initRegistry(&registry, engine);
 
     char district[50], town[50], hasMunicipality[4];
     int population, elevation;
 
-    // Read data from the file and insert into the AVL tree and hash table
-    while (fscanf(file, "%[^:]:%[^:]:%d:%d:%s\n", district, town, &population, &elevation, hasMunicipality) != EOF) {
-        root = insert(root, district, town, population, elevation, hasMunicipality);
-        insertIntoHashTable(hashTable, findTown(root, town));
+    // Restore the last binary snapshot if there is one, otherwise import districts.txt
+    uint64_t loadStarted = monotonicNanoseconds();
+    int restored = loadSnapshot(SNAPSHOT_FILE, registry.hashTable, &registry.root, &registry.generation);
+    if (restored == 0) {
+        // Starting over from districts.txt would drop the snapshot's changes and the log built on it
+        printf("%s could not be loaded. Move it aside to start from districts.txt.\n", SNAPSHOT_FILE);
+        return 1;
     }
+    if (restored > 0) {
+        printf("Restored %d towns from %s\n", registry.hashTable->count, SNAPSHOT_FILE);
+    } else {
+        FILE *file = fopen("districts.txt", "r");
+        if (file == NULL) {
+            printf("File not found. Creating a new file...\n");
+            file = fopen("districts.txt", "w");
+            if (file == NULL) {
+                perror("Error creating file");
+                return 1;
+            }
+            // Add sample data to the file
+            fprintf(file, "AlQuds:Hezma:5000:550:yes\n");
+            fprintf(file, "Nablus:Asira:8000:350:yes\n");
+            fprintf(file, "AlQuds:Qatanna:3000:300:No\n");
+            fprintf(file, "Jenin:Yabad:12000:200:yes\n");
+        }
 
-    fclose(file);
+        fclose(file);
 
-    int choice;
-    do {
+        // Read data from the file and build the AVL tree and hash table in bulk
+        registry.root = loadTownFile("districts.txt", registry.hashTable, loadThreads);
+    }
+
+    buildSecondaryIndexes(&registry);
+
+    // Replay the changes made since that state was saved
+    registry.log = openLog(&registry, syncPolicy, groupSize);
+    recordOperation(TIMER_LOAD, loadStarted);
+
+    // Run a command stream instead of the menu when one was given
+    int status = 0;
+    if (batchPath != NULL) {
+        registryLockWriter(&registry);
+        status = runBatch(&registry, batchPath) > 0;
+        registryUnlockWriter(&registry);
+    }
+    if (benchSeconds > 0)
+        runReadBenchmark(&registry, benchSeconds);
+    if (bench.size > 0)
+        runBenchmark(&bench);
+
+    int choice = batchPath != NULL || benchSeconds > 0 || bench.size > 0 ? 15 : 0;
+    while (choice != 15) {
         printf("Main Menu\n");
         printf("1. Insert a new town\n");
         printf("2. Find and update a town\n");
@@ -479,42 +5707,72 @@ int main() {
         printf("11. Search for a town and print collisions\n");
         printf("12. Insert a new record into the hash table\n");
         printf("13. Delete a specific record from the hash table\n");
-        printf("14. Save the data back to the file towns.txt\n");
+        printf("14. Save the data back to %s (rewrites only the changed segments)\n", SEGMENT_DIR);
         printf("15. Exit\n");
+        printf("16. Print hash collision distribution\n");
+        printf("17. Print memory usage\n");
+        printf("18. Save a binary snapshot to %s (folds in %s)\n", SNAPSHOT_FILE, LOG_FILE);
+        printf("19. List towns with population less than a given number\n");
+        printf("20. List towns with population between two numbers\n");
+        printf("21. List the largest towns\n");
+        printf("22. Find the k-th town in alphabetical order\n");
+        printf("23. Find the alphabetical position of a town\n");
+        printf("24. Count towns and total population in a name range\n");
+        printf("25. List towns in a district by municipality status\n");
+        printf("26. Report population and elevation by district\n");
+        printf("27. List towns starting from a name\n");
+        printf("28. Export towns to a file (colon, csv or json)\n");
+        printf("29. Print runtime statistics (text or json)\n");
+        printf("30. Find several towns at once\n");
+        printf("31. List towns starting with a prefix\n");
+        printf("32. Find towns with names close to a given one\n");
         printf("Enter your choice: ");
-        scanf("%d", &choice);
+        if (scanf("%d", &choice) != 1)
+            choice = 15; // End of input
 
+        registryLockWriter(&registry); // The menu is the registry's writer
         switch (choice) {
             case 1: {
                 printf("Enter district: ");
-                scanf("%s", district);
+                scanf("%49s", district);
                 printf("Enter town: ");
-                scanf("%s", town);
+                scanf("%49s", town);
                 printf("Enter population: ");
                 scanf("%d", &population);
                 printf("Enter elevation: ");
                 scanf("%d", &elevation);
                 printf("Has municipality (yes/no): ");
-                scanf("%s", hasMunicipality);
-                root = insert(root, district, town, population, elevation, hasMunicipality);
-                insertIntoHashTable(hashTable, findTown(root, town));
-                printf("Town added successfully!\n");
+                scanf("%3s", hasMunicipality);
+                if (parseMunicipality(hasMunicipality) < 0)
+                    printf("Municipality must be yes or no.\n");
+                else if (registryInsertTown(&registry, internDistrict(&districts, district), town, population, elevation,
+                                            parseMunicipality(hasMunicipality)) != NULL)
+                    printf("Town added successfully!\n");
+                else
+                    printf("Town already exists.\n");
                 break;
             }
             case 2: {
                 printf("Enter town to find: ");
-                scanf("%s", town);
-                Town *foundTown = findTown(root, town);
+                scanf("%49s", town);
+                Town *foundTown = registryFindTown(&registry, town);
                 if (foundTown != NULL) {
                     printf("Town found: %s, District: %s, Population: %d, Elevation: %d, Municipality: %s\n",
-                           foundTown->town, foundTown->district, foundTown->population, foundTown->elevation, foundTown->hasMunicipality);
+                           foundTown->town, districtName(foundTown->districtId), foundTown->population, foundTown->elevation,
+                           municipalityName(foundTown->hasMunicipality));
                     printf("Enter new population: ");
-                    scanf("%d", &foundTown->population);
+                    scanf("%d", &population);
                     printf("Enter new elevation: ");
-                    scanf("%d", &foundTown->elevation);
+                    scanf("%d", &elevation);
                     printf("Has municipality (yes/no): ");
-                    scanf("%s", foundTown->hasMunicipality);
-                    printf("Town updated successfully!\n");
+                    scanf("%3s", hasMunicipality);
+                    if (parseMunicipality(hasMunicipality) < 0) {
+                        printf("Municipality must be yes or no.\n");
+                    } else {
+                        registryUpdateTown(&registry, foundTown, foundTown->districtId, population, elevation,
+                                           parseMunicipality(hasMunicipality));
+                        printf("Town updated successfully!\n");
+                    }
                 } else {
                     printf("Town not found.\n");
                 }
@@ -522,7 +5780,10 @@ int main() {
             }
             case 3: {
                 printf("Towns in alphabetical order:\n");
-                inOrder(root);
+                if (registry.engine == ENGINE_BTREE)
+                    btreeListTownsFrom(&registry.nameTree, NULL, INT_MAX, 0);
+                else
+                    inOrder(registry.root);
                 break;
             }
             case 4: {
@@ -530,84 +5791,282 @@ int main() {
                 printf("Enter population filter: ");
                 scanf("%d", &populationFilter);
                 printf("Towns with population greater than %d:\n", populationFilter);
-                listTownsByPopulation(root, populationFilter);
+                listTownsByPopulation(registry.populationRoot, populationFilter);
                 break;
             }
             case 5: {
                 char municipalityFilter[4];
                 printf("Enter municipality filter (yes/no): ");
-                scanf("%s", municipalityFilter);
-                printf("Towns with municipality status '%s':\n", municipalityFilter);
-                listTownsByMunicipality(root, municipalityFilter);
+                scanf("%3s", municipalityFilter);
+                if (parseMunicipality(municipalityFilter) < 0) {
+                    printf("Municipality must be yes or no.\n");
+                    break;
+                }
+                printf("Towns with municipality status '%s':\n", municipalityName(parseMunicipality(municipalityFilter)));
+                listTownsByMunicipality(&registry.bitmaps, parseMunicipality(municipalityFilter));
                 break;
             }
-            case 6: {
+            case 6:
+            case 13: {
                 printf("Enter town to delete: ");
-                scanf("%s", town);
-                root = deleteTown(root, town);
-                deleteFromHashTable(hashTable, town);
-                printf("Town deleted successfully!\n");
+                scanf("%49s", town);
+                if (registryDeleteTown(&registry, town))
+                    printf("Town deleted successfully!\n");
+                else
+                    printf("Town not found.\n");
                 break;
             }
-            case 7: {
-                FILE *outFile = fopen("towns.txt", "w");
-                if (outFile == NULL) {
-                    printf("Error opening file!\n");
-                } else {
-                    saveToFile(root, outFile);
-                    fclose(outFile);
-                    printf("Data saved to towns.txt successfully!\n");
-                }
+            case 7:
+            case 14: {
+                if (saveSegments(&registry.segments, registry.root))
+                    printf("Data saved to %s successfully! (%d segments, %ld towns written)\n", SEGMENT_DIR,
+                           registry.segments.lastWritten, registry.segments.lastTowns);
+                else
+                    printf("Error writing %s!\n", SEGMENT_DIR);
                 break;
             }
             case 8: {
                 printf("Hash table:\n");
-                printHashedTable(hashTable);
+                printHashedTable(registry.hashTable);
                 break;
             }
             case 9: {
                 printf("Hash table stats:\n");
-                printHashTableStats(hashTable);
+                printHashTableStats(registry.hashTable);
                 break;
             }
             case 10: {
                 printf("Printing hashed table (including empty spots):\n");
-                printHashedTable(hashTable);
+                printHashedTable(registry.hashTable);
                 break;
             }
             case 11: {
                 printf("Enter town to search: ");
-                scanf("%s", town);
-                searchTownInHashTable(hashTable, town);
+                scanf("%49s", town);
+                searchTownInHashTable(registry.hashTable, town);
                 break;
             }
             case 12: {
                 printf("Inserting a new record into the hash table...\n");
-                insertNewRecordIntoHashTable(hashTable, root);
+                insertNewRecordIntoHashTable(&registry);
                 break;
             }
-            case 13: {
-                printf("Enter town to delete: ");
-                scanf("%s", town);
-                root = deleteTown(root, town);
-                deleteFromHashTable(hashTable, town);
-                updateFileAfterDeletion(root, town);
-                printf("Town deleted successfully!\n");
+            case 15: {
+                printf("Exiting...\n");
                 break;
             }
-            case 14: {
-                FILE *outFile = fopen("towns.txt", "w");
-                if (outFile == NULL) {
-                    printf("Error opening file!\n");
+            case 16: {
+                printCollisionReport(registry.hashTable);
+                break;
+            }
+            case 17: {
+                printMemoryStats(registry.hashTable);
+                break;
+            }
+            case 18: {
+                if (compactRegistry(&registry))
+                    printf("Snapshot saved to %s successfully!\n", SNAPSHOT_FILE);
+                break;
+            }
+            case 19: {
+                int populationFilter;
+                printf("Enter population filter: ");
+                scanf("%d", &populationFilter);
+                printf("Towns with population less than %d:\n", populationFilter);
+                if (populationFilter > INT_MIN)
+                    listTownsInPopulationRange(registry.populationRoot, INT_MIN, populationFilter - 1);
+                break;
+            }
+            case 20: {
+                int minPopulation, maxPopulation;
+                printf("Enter minimum population: ");
+                scanf("%d", &minPopulation);
+                printf("Enter maximum population: ");
+                scanf("%d", &maxPopulation);
+                printf("Towns with population between %d and %d:\n", minPopulation, maxPopulation);
+                listTownsInPopulationRange(registry.populationRoot, minPopulation, maxPopulation);
+                break;
+            }
+            case 21: {
+                int count;
+                printf("Enter number of towns: ");
+                scanf("%d", &count);
+                printf("The %d largest towns:\n", count);
+                listLargestTowns(registry.populationRoot, count);
+                break;
+            }
+            case 22: {
+                int k;
+                printf("Enter position: ");
+                scanf("%d", &k);
+                Town *foundTown = selectTown(registry.root, k);
+                if (foundTown != NULL)
+                    printTown(foundTown);
+                else
+                    printf("There are only %d towns.\n", subtreeSize(registry.root));
+                break;
+            }
+            case 23: {
+                printf("Enter town: ");
+                scanf("%49s", town);
+                int rank = rankTown(registry.root, town);
+                if (rank > 0)
+                    printf("%s is town %d of %d in alphabetical order.\n", town, rank, subtreeSize(registry.root));
+                else
+                    printf("Town not found.\n");
+                break;
+            }
+            case 24: {
+                char from[50], to[50];
+                int countFrom, countTo;
+                long long populationFrom, populationTo;
+                printf("Enter first name of the range: ");
+                scanf("%49s", from);
+                printf("Enter last name of the range: ");
+                scanf("%49s", to);
+                countTownsBefore(registry.root, from, 0, &countFrom, &populationFrom);
+                countTownsBefore(registry.root, to, 1, &countTo, &populationTo);
+                if (countTo < countFrom) {
+                    countTo = countFrom; // An empty range
+                    populationTo = populationFrom;
+                }
+                printf("Towns from '%s' to '%s': %d, total population: %lld\n",
+                       from, to, countTo - countFrom, populationTo - populationFrom);
+                break;
+            }
+            case 25: {
+                char municipalityFilter[4];
+                printf("Enter district: ");
+                scanf("%49s", district);
+                printf("Enter municipality filter (yes/no/any): ");
+                scanf("%3s", municipalityFilter);
+                int districtId = findDistrict(&districts, district);
+                int hasMunicipalityFilter = parseMunicipality(municipalityFilter);
+                if (districtId < 0) {
+                    printf("District not found.\n");
+                } else if (hasMunicipalityFilter < 0 && strcasecmp(municipalityFilter, "any") != 0) {
+                    printf("Municipality must be yes, no or any.\n");
                 } else {
-                    saveToFile(root, outFile);
-                    fclose(outFile);
-                    printf("Data saved to towns.txt successfully!\n");
+                    printf("Towns in district %s:\n", districtName(districtId));
+                    listTownsByBitmap(&registry.bitmaps, districtId, hasMunicipalityFilter);
                 }
                 break;
             }
-            case 15: {
-                printf("Exiting...\n");
+            case 26: {
+                int minPopulation, maxPopulation, minElevation, maxElevation;
+                printf("Enter minimum population: ");
+                scanf("%d", &minPopulation);
+                printf("Enter maximum population: ");
+                scanf("%d", &maxPopulation);
+                printf("Enter minimum elevation: ");
+                scanf("%d", &minElevation);
+                printf("Enter maximum elevation: ");
+                scanf("%d", &maxElevation);
+                if (minPopulation > maxPopulation || minElevation > maxElevation)
+                    printf("No towns match.\n");
+                else
+                    printDistrictReport(&registry.columns, &registry.bitmaps, minPopulation, maxPopulation, minElevation, maxElevation);
+                break;
+            }
+            case 27: {
+                int count;
+                printf("Enter town to start from: ");
+                scanf("%49s", town);
+                printf("Enter number of towns (negative lists the towns before it): ");
+                scanf("%d", &count);
+                if (registry.engine == ENGINE_BTREE)
+                    btreeListTownsFrom(&registry.nameTree, town, count < 0 ? -count : count, count < 0);
+                else
+                    listTownsFrom(registry.root, town, count < 0 ? -count : count, count < 0);
+                break;
+            }
+            case 28: {
+                char path[256], formatName[8];
+                printf("Enter file name: ");
+                scanf("%255s", path);
+                printf("Enter format (colon/csv/json): ");
+                scanf("%7s", formatName);
+                int format = parseOutputFormat(formatName);
+                if (format < 0 || format == OUTPUT_TEXT)
+                    printf("Format must be colon, csv or json.\n");
+                else if (saveToFile(registry.root, path, format))
+                    printf("Data exported to %s successfully!\n", path);
+                else
+                    printf("Error writing %s!\n", path);
+                break;
+            }
+            case 29: {
+                char formatName[8];
+                printf("Enter format (text/json): ");
+                scanf("%7s", formatName);
+                if (strcasecmp(formatName, "json") == 0)
+                    printRuntimeStats(&registry, 1);
+                else if (strcasecmp(formatName, "text") == 0)
+                    printRuntimeStats(&registry, 0);
+                else
+                    printf("Format must be text or json.\n");
+                break;
+            }
+            case 30: {
+                int count;
+                printf("Enter number of towns: ");
+                scanf("%d", &count);
+                if (count <= 0)
+                    break;
+                char (*names)[50] = malloc((size_t)count * sizeof(*names));
+                char **towns = (char**)malloc((size_t)count * sizeof(char*));
+                Town **results = (Town**)malloc((size_t)count * sizeof(Town*));
+                if (names == NULL || towns == NULL || results == NULL) {
+                    printf("Memory allocation failed!\n");
+                } else {
+                    printf("Enter the towns: ");
+                    for (int i = 0; i < count; i++) {
+                        if (scanf("%49s", names[i]) != 1)
+                            names[i][0] = '\0';
+                        towns[i] = names[i];
+                    }
+                    int found = registryFindTowns(&registry, towns, count, results);
+                    for (int i = 0; i < count; i++)
+                        if (results[i] != NULL)
+                            printTown(results[i]);
+                    flushOutput(&output);
+                    for (int i = 0; i < count; i++)
+                        if (results[i] == NULL)
+                            printf("Town not found: %s\n", towns[i]);
+                    printf("Found %d of %d towns.\n", found, count);
+                }
+                free(names);
+                free(towns);
+                free(results);
+                break;
+            }
+            case 31: {
+                int count;
+                printf("Enter prefix: ");
+                scanf("%49s", town);
+                printf("Enter number of towns to list: ");
+                scanf("%d", &count);
+                int total = registryListPrefix(&registry, town, count);
+                printf("%d towns start with '%s'.\n", total, town);
+                break;
+            }
+            case 32: {
+                int maxEdits;
+                printf("Enter town: ");
+                scanf("%49s", town);
+                printf("Enter largest number of edits (0-%d): ", FUZZY_MAX_EDITS);
+                scanf("%d", &maxEdits);
+                if (maxEdits < 0 || maxEdits > FUZZY_MAX_EDITS) {
+                    printf("Edits must be between 0 and %d.\n", FUZZY_MAX_EDITS);
+                    break;
+                }
+                if (maxEdits > fuzzyEditLimit(strlen(town))) {
+                    maxEdits = fuzzyEditLimit(strlen(town));
+                    printf("Names this short allow at most %d edits.\n", maxEdits);
+                }
+                printf("Towns within %d edits of '%s', closest first:\n", maxEdits, town);
+                if (registryListFuzzy(&registry, town, maxEdits, INT_MAX) == 0)
+                    printf("No towns match.\n");
                 break;
             }
             default: {
@@ -615,7 +6074,18 @@ int main() {
                 break;
             }
         }
-    } while (choice != 15);
+        flushOutput(&output); // Rows printed for this action
 
-    return 0;
+        // Make this action's changes durable
+        commitRegistry(&registry);
+        registryUnlockWriter(&registry);
+    }
+
+    // Release every town and the hash table in one go
+    closeLog(registry.log);
+    freeRegistry(&registry);
+    clearDistrictTable(&districts);
+    destroyTownPool();
+
+    return status;
 }
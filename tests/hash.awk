@@ -0,0 +1,61 @@
+#!/usr/bin/awk -f
+# Write the batch for the hash index scenario of run.sh. It expects the 2500
+# towns town0000 ... town2499 to be loaded and adds new0000 ... new2499.
+
+# Function to get the name of town k of the 5000 the scenario works with
+function name(k) {
+    return k < 2500 ? sprintf("town%04d", k) : sprintf("new%04d", k - 2500)
+}
+
+# Function to look up 16 towns spread over every name, present or not
+function probe(seed,    line, j) {
+    line = "mget"
+    for (j = 0; j < 16; j++)
+        line = line " " name((seed * 131 + j * 229) % 5000)
+    print line
+}
+
+BEGIN {
+    # Delete most of the loaded towns; those in the middle of a chain leave tombstones
+    for (i = 0; i < 1800; i++) {
+        print "delete " name((i * 1237) % 2500)
+        if (i % 100 == 99)
+            probe(i)
+    }
+
+    # Short-lived towns keep adding tombstones without adding towns, until
+    # the table is rebuilt at the same size to drop them
+    for (i = 0; i < 3000; i++) {
+        printf "insert D0 churn%04d 1 1 no\n", i
+        if (i >= 100)
+            printf "delete churn%04d\n", i - 100
+        if (i % 100 == 99)
+            probe(i)
+    }
+    for (i = 2900; i < 3000; i++)
+        printf "delete churn%04d\n", i
+
+    # Grow the table; lookups every 50 changes run while slots are being migrated
+    for (i = 0; i < 2500; i++) {
+        printf "insert D%d new%04d %d %d %s\n", i % 5, i, (i * 53) % 10000, (i * 7) % 900, i % 2 ? "yes" : "no"
+        if (i % 50 == 49)
+            probe(i)
+    }
+
+    # Delete and bring back towns all over the grown table, and change some
+    for (i = 0; i < 1000; i++)
+        print "delete " name((i * 1237 + 11) % 5000)
+    for (i = 0; i < 200; i++)
+        printf "insert D6 %s %d 1 yes\n", name((i * 1237 + 11) % 5000), 20000 + i
+    for (i = 0; i < 50; i++)
+        printf "update %s %d 2 no D5\n", name((i * 1237 + 7) % 5000), 30000 + i
+
+    # Every name once more, in order
+    for (k = 0; k < 5000; k += 50) {
+        line = "mget"
+        for (j = k; j < k + 50; j++)
+            line = line " " name(j)
+        print line
+    }
+    print "stats"
+}
@@ -0,0 +1,145 @@
+#!/bin/sh
+# Run the scenarios below against a fresh build of main.c and compare what
+# they print with the expected listings next to this script.
+#
+#   tests/run.sh            build, run every scenario, report differences
+#   tests/run.sh --update   rewrite the expected listings from this build
+#
+# The hash seed changes with every run, so the listings only hold what a
+# correct registry must print whatever the slot layout is.
+
+cd "$(dirname "$0")" || exit 1
+tests=$(pwd)
+update=0
+[ "$1" = "--update" ] && update=1
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+${CC:-gcc} -O2 -pthread -Wall -Wextra -o "$work/towns" ../main.c || exit 1
+towns="$work/towns"
+failed=0
+
+# Function to start a scenario in an empty directory holding `count` towns
+# named town0000, town0001, ... spread over seven districts
+setUp() {
+    rm -rf "$work/run"
+    mkdir "$work/run" && cd "$work/run" || exit 1
+    awk -v count="$2" 'BEGIN {
+        for (i = 0; i < count; i++)
+            printf "D%d:town%04d:%d:%d:%s\n", i % 7, i, (i * 37) % 10000, (i * 13) % 900, i % 3 ? "yes" : "no"
+    }' > districts.txt
+    scenario=$1
+    label=$1
+    broken=0
+}
+
+# Function to compare a scenario's output with its expected listing
+check() {
+    if [ $update = 1 ]; then
+        cp "$1" "$tests/$scenario.expected"
+    elif diff -u "$tests/$scenario.expected" "$1" > "$work/diff"; then
+        [ $broken = 0 ] && echo "ok    $label"
+        return
+    else
+        echo "FAIL  $label"
+        head -40 "$work/diff"
+        failed=1
+    fi
+}
+
+# Function to fail a scenario with a message
+fail() {
+    echo "FAIL  $label: $1"
+    failed=1
+    broken=1
+}
+
+# Hash index: deletes leave tombstones that are swept backwards or compacted
+# away, inserts grow the table while lookups run against slots that are still
+# being migrated, and deleted towns come back. See hash.awk for the details.
+for engine in avl btree; do
+    setUp hash 2500
+    label="hash ($engine)"
+    "$tests/hash.awk" > hash.batch
+    "$towns" --engine=$engine --fsync=none --format=colon --batch=hash.batch > out 2> err
+    grep -q '"compactions":[1-9]' out || fail "the table was never compacted"
+    grep -v '^{' out > listing # Drop the statistics, their timings change every run
+    check listing
+done
+
+# Change log: a torn record at the end of towns.wal is dropped, the complete
+# records before it are replayed, and changes made afterwards follow them
+setUp wal 2500
+"$towns" --fsync=always --format=colon --batch="$tests/wal-changes.batch" > /dev/null 2> err
+truncate -s -50 towns.wal
+{
+    "$towns" --fsync=always --format=colon --batch="$tests/wal-check.batch" 2> err
+    echo "insert D9 zzz-after 1 2 yes" | "$towns" --fsync=always --format=colon --batch=- 2> err
+    "$towns" --fsync=always --format=colon --batch="$tests/wal-check.batch" 2> err
+} > out
+check out
+
+# A damaged snapshot stops the program instead of falling back to
+# districts.txt, and a log left without its snapshot is moved aside, not lost
+setUp wal 2500
+label="wal (orphaned)"
+printf '18\n15\n' | "$towns" > /dev/null 2> err
+"$towns" --fsync=always --format=colon --batch="$tests/wal-changes.batch" > /dev/null 2> err
+cp towns.wal logged.wal
+printf 'X' | dd of=towns.snap bs=1 seek=100 conv=notrunc 2> /dev/null
+printf '15\n' | "$towns" > /dev/null 2> err && fail "a damaged snapshot was not reported"
+cmp -s towns.wal logged.wal || fail "the log changed while the snapshot was damaged"
+rm towns.snap
+printf '15\n' | "$towns" > /dev/null 2> err
+cmp -s towns.wal.orphan logged.wal || fail "the orphaned log was not kept"
+[ $broken = 0 ] && [ $update = 0 ] && echo "ok    $label"
+
+# Segmented save: the first save writes every segment, later saves rewrite the
+# segments that changed, cut one that grew too large and drop one that emptied.
+# Each session replays the rounds up to one more than the last, so the files
+# can be checked after every save: the manifest's files together must equal a
+# full export, and no file outside the manifest may be left behind.
+round() {
+    case $1 in
+        1) printf '14\n' ;;
+        2) printf '1\nD1\naaa-first\n5\n5\nyes\n6\ntown1024\n2\ntown1500\n99\n9\nno\n14\n' ;;
+        3) i=0
+           while [ $i -lt 1100 ]; do
+               printf '1\nD2\ntown0100x%04d\n%d\n1\nyes\n' $i $i
+               i=$((i + 1))
+           done
+           printf '14\n' ;;
+        4) i=2048
+           while [ $i -lt 3000 ]; do
+               printf '6\ntown%04d\n' $i
+               i=$((i + 1))
+           done
+           printf '14\n' ;;
+    esac
+}
+for rounds in 1 2 3 4; do
+    setUp segments 3000
+    label="segments (round $rounds)"
+    {
+        r=1
+        while [ $r -le $rounds ]; do
+            round $r
+            r=$((r + 1))
+        done
+        printf '28\nexport.txt\ncolon\n15\n'
+    } | "$towns" --fsync=none > /dev/null 2> err
+    if [ ! -f towns.txt.d/manifest ]; then
+        fail "no manifest was written"
+        continue
+    fi
+    (cd towns.txt.d && cat $(cut -d' ' -f1 manifest)) > segments.txt
+    cmp -s segments.txt export.txt || fail "segments differ from the export"
+    [ "$(ls towns.txt.d | grep -c '^segment-')" = "$(wc -l < towns.txt.d/manifest | tr -d ' ')" ] ||
+        fail "stale segment files were left behind"
+    [ $broken = 0 ] && [ $update = 0 ] && echo "ok    $label"
+done
+label=segments
+check towns.txt.d/manifest # Which segments the last rounds rewrote, cut and dropped
+
+[ $update = 1 ] && echo "Expected listings updated."
+exit $failed